@@ -0,0 +1,379 @@
+#!/usr/bin/env python3
+"""
+Microbenchmarks of fat guards.
+
+Usage: python3 bench_fat.py [-o results.json] [--compare reference.json]
+
+Each benchmark reports the average cost of a guard check in nanoseconds.
+Check functions are called directly in C by fat._bench_check(), the
+cost of the loop is subtracted. ReplaceConsts benchmarks report the
+average cost of a fat.replace_consts() call.
+
+Benchmark names are stable: write results of a release with --output and
+compare them to results of another release with --compare to catch
+regressions.
+"""
+
+# Disable fatoptimizer on this module
+__fatoptimizer__ = {'enabled': False}
+
+import argparse
+import json
+import os.path
+import sys
+import time
+
+import fat
+
+
+NUMBER = 10 ** 6
+REPEAT = 5
+# number of checks between two modifications of the dict
+MUTATE_EVERY = (1, 10)
+
+
+def bench(guards, args=(), dict=None, number=NUMBER, mutate_every=1):
+    """Return the minimum cost of a guard check in nanoseconds."""
+    return min(fat._bench_check(guards, number, args, dict, mutate_every)
+               for run in range(REPEAT)) * 1e9
+
+
+def bind(guards):
+    """Use guards to specialize a function of this module: guards checking
+    globals are bound to the function globals and don't read the current
+    frame anymore."""
+    def func():
+        pass
+
+    def fast():
+        pass
+
+    if not isinstance(guards, tuple):
+        guards = (guards,)
+    fat.specialize(func, fast, guards)
+    if not fat.get_specialized(func):
+        raise Exception("guards failed")
+
+
+def bench_arg_type(nb_arg_type, match=True):
+    """GuardArgType check of an argument, the argument type is the last
+    accepted type if match is true, or not accepted otherwise."""
+    types = [type('Type%s' % i, (), {}) for i in range(nb_arg_type)]
+    guard = fat.GuardArgType(0, types)
+    if match:
+        arg = types[-1]()
+    else:
+        arg = object()
+    return bench(guard, (arg,))
+
+
+def bench_arg_type_subclass(depth):
+    """GuardArgType check with subclasses=True of an argument whose type
+    is a subclass of the accepted type, depth levels below it."""
+    cls = base = type('Base', (), {})
+    for i in range(depth):
+        cls = type('Sub%s' % i, (cls,), {})
+    guard = fat.GuardArgType(0, (base,), subclasses=True)
+    return bench(guard, (cls(),))
+
+
+def bench_arg_types(narg, many_guards=False):
+    """Check the type of narg arguments with a single GuardArgTypes, or
+    with one GuardArgType per argument if many_guards is true."""
+    args = tuple(range(narg))
+    if many_guards:
+        guards = tuple(fat.GuardArgType(index, (int,))
+                       for index in range(narg))
+    else:
+        guards = fat.GuardArgTypes([(index, (int,))
+                                    for index in range(narg)])
+    return bench(guards, args)
+
+
+def bench_arg_value(nvalue, match=True):
+    """GuardArgValue check of an argument, the argument is the last
+    accepted value if match is true, or not accepted otherwise."""
+    values = (None, False, True, 0, 1, 'strict')[:nvalue]
+    guard = fat.GuardArgValue(0, values)
+    if match:
+        arg = values[-1]
+    else:
+        arg = 'other'
+    return bench(guard, (arg,))
+
+
+def bench_arg_int_range(arg):
+    """GuardArgIntRange check of an argument on a 63-bit signed range."""
+    guard = fat.GuardArgIntRange(0, -2 ** 62, 2 ** 62)
+    return bench(guard, (arg,))
+
+
+def bench_func():
+    """GuardFunc check, the code of the function is unchanged."""
+    def func():
+        pass
+
+    return bench(fat.GuardFunc(func))
+
+
+def bench_cell():
+    """GuardCell check, the content of the closure cell is unchanged."""
+    helper = len
+
+    def func(seq):
+        return helper(seq)
+
+    return bench(fat.GuardCell(func, 'helper'))
+
+
+def bench_dict(npair, mutate_every=None, missing=False):
+    """GuardDict check on npair keys.
+
+    If mutate_every is set, an unrelated key of the dict is modified
+    every mutate_every checks: the dict version changed, so watched keys
+    are checked. If missing is true, watched keys don't exist in the
+    dict, as the globals dict watched by GuardBuiltins."""
+    keys = ['key%s' % i for i in range(npair)]
+    if missing:
+        ns = {}
+    else:
+        ns = {key: object() for key in keys}
+
+    guard = fat.GuardDict(ns, *keys)
+    if mutate_every is None:
+        return bench(guard)
+    return bench(guard, dict=ns, mutate_every=mutate_every)
+
+
+def bench_dict_many_guards(nguard, npair):
+    """nguard GuardDict guards watching the same npair keys of a dict,
+    as GuardGlobals of functions of a module, when an unrelated key of
+    the dict is modified. Return the cost per guard."""
+    keys = ['key%s' % i for i in range(npair)]
+    ns = {key: object() for key in keys}
+
+    guards = tuple(fat.GuardDict(ns, *keys) for i in range(nguard))
+    return bench(guards, dict=ns, number=NUMBER // nguard) / nguard
+
+
+def bench_globals(mutate_every=None, bound=False):
+    """GuardGlobals check on 3 names. If mutate_every is set, an
+    unrelated global variable is modified every mutate_every checks. If
+    bound is true, the guard is bound to a function."""
+    guard = fat.GuardGlobals('bench', 'fat', 'NUMBER')
+    if bound:
+        bind(guard)
+    if mutate_every is None:
+        return bench(guard)
+    return bench(guard, dict=globals(), mutate_every=mutate_every)
+
+
+def bench_builtins(mutate_every=None, bound=False):
+    """GuardBuiltins check on 3 builtins. If mutate_every is set, an
+    unrelated global variable is modified every mutate_every checks. If
+    bound is true, the guard is bound to a function."""
+    guard = fat.GuardBuiltins('len', 'range', 'isinstance')
+    if bound:
+        bind(guard)
+    if mutate_every is None:
+        return bench(guard)
+    return bench(guard, dict=globals(), mutate_every=mutate_every)
+
+
+def bench_module_attr(fused=True, mutate_every=None, bound=False):
+    """Guard on os.path.join: a single GuardModuleAttr if fused is true,
+    or GuardGlobals and two GuardDict guards otherwise. If mutate_every is
+    set, an unrelated global variable is modified every mutate_every
+    checks. If bound is true, guards are bound to a function."""
+    if fused:
+        guards = fat.GuardModuleAttr('os', 'path.join')
+    else:
+        guards = (fat.GuardGlobals('os'),
+                  fat.GuardDict(os.__dict__, 'path'),
+                  fat.GuardDict(os.path.__dict__, 'join'))
+    if bound:
+        bind(guards)
+    if mutate_every is None:
+        return bench(guards)
+    return bench(guards, dict=globals(), mutate_every=mutate_every)
+
+
+def bench_type(nattr):
+    """GuardType check on nattr attributes of a subclass, attributes
+    are defined in the base class."""
+    attrs = ['attr%s' % i for i in range(nattr)]
+    base = type('Base', (), {attr: object() for attr in attrs})
+    cls = type('MyClass', (base,), {})
+    guard = fat.guard_type_dict(cls, attrs)
+    return bench(guard)
+
+
+def bench_instance_shape():
+    """GuardInstanceShape check on an instance with 2 attributes."""
+    class Point:
+        def __init__(self, x, y):
+            self.x = x
+            self.y = y
+
+    guard = fat.GuardInstanceShape(Point)
+    return bench(guard, (Point(1, 2),))
+
+
+def bench_replace_consts(nconst, nreplace):
+    """replace_consts() on generated code with nconst constants (strings
+    and integers), nreplace of them are replaced."""
+    consts = []
+    for i in range(nconst):
+        if i % 2:
+            consts.append(repr('const%s' % i))
+        else:
+            consts.append(str(1000 + i))
+    source = 'def func():\n    return [%s]\n' % ', '.join(consts)
+    ns = {}
+    exec(source, ns, ns)
+    code = ns['func'].__code__
+
+    mapping = {'const%s' % (i * 2 + 1): i for i in range(nreplace)}
+    replace_consts = fat.replace_consts
+    loops = range(max(10 ** 5 // nconst, 10))
+
+    best = None
+    for run in range(REPEAT):
+        t0 = time.perf_counter()
+        for _ in loops:
+            replace_consts(code, mapping)
+        dt = time.perf_counter() - t0
+        if best is None or dt < best:
+            best = dt
+    return best / len(loops) * 1e9
+
+
+def benchmarks():
+    """Generate (name, func, args) tuples."""
+    for match in (True, False):
+        for nb_arg_type in (1, 4, 8, 16):
+            name = 'GuardArgType/nb_arg_type=%s' % nb_arg_type
+            if not match:
+                name += '/wrong_type'
+            yield (name, bench_arg_type, (nb_arg_type, match))
+
+    for depth in (1, 10):
+        yield ('GuardArgType/subclass_depth=%s' % depth,
+               bench_arg_type_subclass, (depth,))
+
+    for narg in (1, 3, 6):
+        yield ('GuardArgType/narg=%s' % narg,
+               bench_arg_types, (narg, True))
+        yield ('GuardArgTypes/narg=%s' % narg,
+               bench_arg_types, (narg,))
+
+    for nvalue in (1, 6):
+        yield ('GuardArgValue/nvalue=%s' % nvalue,
+               bench_arg_value, (nvalue,))
+    yield ('GuardArgValue/nvalue=6/wrong_value',
+           bench_arg_value, (6, False))
+
+    for ndigit, arg in ((1, 12345), (2, 2 ** 40), (3, 2 ** 61),
+                        (4, 2 ** 100)):
+        yield ('GuardArgIntRange/ndigit=%s' % ndigit,
+               bench_arg_int_range, (arg,))
+
+    yield ('GuardFunc', bench_func, ())
+    yield ('GuardCell', bench_cell, ())
+
+    for npair in (1, 3, 10):
+        yield ('GuardDict/npair=%s' % npair, bench_dict, (npair,))
+        for mutate_every in MUTATE_EVERY:
+            for missing in (False, True):
+                name = ('GuardDict/npair=%s/mutate_every=%s'
+                        % (npair, mutate_every))
+                if missing:
+                    name += '/missing'
+                yield (name, bench_dict, (npair, mutate_every, missing))
+
+    for nguard in (10, 200):
+        yield ('GuardDict/nguard=%s/npair=3/mutate_every=1' % nguard,
+               bench_dict_many_guards, (nguard, 3))
+
+    for name, func in (('GuardGlobals', bench_globals),
+                       ('GuardBuiltins', bench_builtins)):
+        yield (name, func, ())
+        yield (name + '/bound', func, (None, True))
+        for mutate_every in MUTATE_EVERY:
+            yield ('%s/mutate_every=%s' % (name, mutate_every),
+                   func, (mutate_every,))
+
+    for fused in (True, False):
+        name = 'GuardModuleAttr/depth=2'
+        if not fused:
+            name += '/unfused'
+        yield (name, bench_module_attr, (fused,))
+        yield (name + '/bound', bench_module_attr, (fused, None, True))
+        yield (name + '/mutate_every=1', bench_module_attr, (fused, 1))
+
+    for nattr in (1, 10):
+        yield ('GuardType/nattr=%s' % nattr, bench_type, (nattr,))
+
+    yield ('GuardInstanceShape', bench_instance_shape, ())
+
+    for nconst in (10, 1000, 10000):
+        for nreplace in (0, 1, 5):
+            yield ('ReplaceConsts/nconst=%s/nreplace=%s' % (nconst, nreplace),
+                   bench_replace_consts, (nconst, nreplace))
+
+
+def compare(reference, results):
+    for name, cost in sorted(results.items()):
+        if name not in reference:
+            print("%s: %.1f ns (new)" % (name, cost))
+            continue
+
+        ref = reference[name]
+        if cost <= 0 or ref <= 0:
+            # too fast to be measured
+            change = 'not significant'
+        elif cost >= ref:
+            change = '%.2fx slower' % (cost / ref)
+        else:
+            change = '%.2fx faster' % (ref / cost)
+        print("%s: %.1f ns => %.1f ns (%s)" % (name, ref, cost, change))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Microbenchmarks of fat guards")
+    parser.add_argument('-o', '--output',
+                        help="write results into a JSON file")
+    parser.add_argument('--compare', metavar='REFERENCE',
+                        help="compare results to a JSON file written "
+                             "by --output")
+    args = parser.parse_args()
+
+    reference = None
+    if args.compare:
+        with open(args.compare) as fp:
+            reference = json.load(fp)['benchmarks']
+
+    results = {}
+    for name, func, func_args in benchmarks():
+        cost = func(*func_args)
+        results[name] = round(cost, 1)
+        if reference is None:
+            print("%s: %.1f ns" % (name, cost))
+
+    if reference is not None:
+        compare(reference, results)
+
+    if args.output:
+        data = {
+            'fat_version': fat.__version__,
+            'python_version': sys.version.split()[0],
+            'unit': 'ns',
+            'benchmarks': results,
+        }
+        with open(args.output, 'w') as fp:
+            json.dump(data, fp, indent=4, sort_keys=True)
+            fp.write('\n')
+
+
+if __name__ == "__main__":
+    main()
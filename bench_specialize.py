@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmarks of specialized functions.
+
+Usage: python3 bench_specialize.py [-o results.json]
+
+Must be run on a Python implementing the PEP 510. Each benchmark reports
+calls per second of:
+
+* generic: the function without specialization
+* specialized: the specialized function, guards pass
+* fallback: the specialized function called with arguments which fail
+  guards, so the generic code is called after checking guards
+
+The fallback overhead is computed against the generic function called
+with the same arguments.
+"""
+
+# Disable fatoptimizer on this module
+__fatoptimizer__ = {'enabled': False}
+
+import argparse
+import json
+import sys
+import time
+import types
+
+import fat
+
+
+LOOPS = 10 ** 5
+REPEAT = 5
+FACTOR = 3
+
+
+class List(list):
+    pass
+
+
+class Int(int):
+    pass
+
+
+def len_generic(seq):
+    return len(seq)
+
+
+def len_fast(seq):
+    # 'LEN' is replaced with the len() builtin function
+    return 'LEN'(seq)
+
+
+def range_generic(n):
+    total = 0
+    for i in range(n):
+        total += i
+    return total
+
+
+def range_fast(n):
+    total = 0
+    # 'RANGE' is replaced with the range type
+    for i in 'RANGE'(n):
+        total += i
+    return total
+
+
+def scale_generic(x):
+    return x * FACTOR
+
+
+def scale_fast(x):
+    # 'FACTOR' is replaced with the value of the FACTOR global variable
+    return x * 'FACTOR'
+
+
+def add_generic(x, y):
+    if isinstance(x, int) and isinstance(y, int):
+        return x + y
+    return float(x) + float(y)
+
+
+def add_fast(x, y):
+    return x + y
+
+
+def scenarios():
+    """Generate (name, generic, fast, consts, guards, args, fail_args)
+    tuples."""
+    yield ('builtin len',
+           len_generic, len_fast, {'LEN': len},
+           lambda: [fat.GuardArgType(0, (list,)), fat.GuardBuiltins('len')],
+           ([1, 2, 3],), (List([1, 2, 3]),))
+
+    yield ('builtin range',
+           range_generic, range_fast, {'RANGE': range},
+           lambda: [fat.GuardArgType(0, (int,)), fat.GuardBuiltins('range')],
+           (10,), (Int(10),))
+
+    yield ('constant global',
+           scale_generic, scale_fast, {'FACTOR': FACTOR},
+           lambda: [fat.GuardArgType(0, (int,)), fat.GuardGlobals('FACTOR')],
+           (5,), (Int(5),))
+
+    yield ('arithmetic on int',
+           add_generic, add_fast, None,
+           lambda: [fat.GuardArgTypes([(0, (int,)), (1, (int,))])],
+           (1, 2), (1.0, 2.0))
+
+
+def copy_func(func):
+    return types.FunctionType(func.__code__, func.__globals__,
+                              func.__name__, func.__defaults__,
+                              func.__closure__)
+
+
+def timeit(func, args):
+    """Return the number of calls per second."""
+    loops = range(LOOPS)
+    best = None
+    for run in range(REPEAT):
+        t0 = time.perf_counter()
+        for _ in loops:
+            func(*args)
+        dt = time.perf_counter() - t0
+        if best is None or dt < best:
+            best = dt
+    return LOOPS / best
+
+
+def bench_scenario(generic, fast, consts, create_guards, args, fail_args):
+    code = fast.__code__
+    if consts is not None:
+        code = fat.replace_consts(code, consts)
+
+    specialized = copy_func(generic)
+    fat.specialize(specialized, code, create_guards())
+    if specialized(*args) != generic(*args):
+        raise Exception("specialized code gives a different result")
+    if len(fat.get_specialized(specialized)) != 1:
+        raise Exception("guards failed")
+
+    generic = copy_func(generic)
+    return {
+        'generic': timeit(generic, args),
+        'specialized': timeit(specialized, args),
+        'fallback': timeit(specialized, fail_args),
+        'generic_fallback_args': timeit(generic, fail_args),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="End-to-end benchmarks of specialized functions")
+    parser.add_argument('-o', '--output',
+                        help="write results into a JSON file")
+    args = parser.parse_args()
+
+    results = {}
+    for name, *scenario in scenarios():
+        res = bench_scenario(*scenario)
+        results[name] = {key: round(value) for key, value in res.items()}
+
+        speedup = res['specialized'] / res['generic']
+        overhead = res['generic_fallback_args'] / res['fallback'] - 1.0
+        print("%s:" % name)
+        print("  generic: %.0f calls/sec" % res['generic'])
+        print("  specialized: %.0f calls/sec (%.2fx)"
+              % (res['specialized'], speedup))
+        print("  fallback: %.0f calls/sec (overhead: %+.1f%%)"
+              % (res['fallback'], overhead * 100))
+
+    if args.output:
+        data = {
+            'fat_version': fat.__version__,
+            'python_version': sys.version.split()[0],
+            'unit': 'calls/sec',
+            'benchmarks': results,
+        }
+        with open(args.output, 'w') as fp:
+            json.dump(data, fp, indent=4, sort_keys=True)
+            fp.write('\n')
+
+
+if __name__ == "__main__":
+    main()
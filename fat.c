@@ -1,10 +1,15 @@
 #include "Python.h"
 #include "frameobject.h"
+#include "longintrepr.h"
+#include "opcode.h"
 #include "structmember.h"
 
 #define VERSION "0.3"
 
-static PyObject *init_builtins = NULL;
+/* Copy of the builtins dict when the fat module was imported: GuardBuiltins
+   refuses to specialize a function if a guarded builtin was modified
+   since */
+static PyObject *init_builtins_snapshot = NULL;
 
 #ifdef __GNUC__
 #  define unlikely(x) __builtin_expect(!!(x), 0)
@@ -13,55 +18,454 @@ static PyObject *init_builtins = NULL;
 #endif
 
 
+/* Common guard state */
+
+typedef struct {
+    /* number of checks which succeeded (0) */
+    Py_ssize_t hit;
+    /* number of checks which failed, specialization skipped (1) */
+    Py_ssize_t miss;
+    /* number of checks which failed, specialization removed (2) */
+    Py_ssize_t invalidate;
+} GuardStats;
+
+typedef struct {
+#ifndef FAT_NO_STATS
+    GuardStats stats;
+#endif
+    /* give up on the specialization after max_fails consecutive
+       failures, 0 means no limit */
+    Py_ssize_t max_fails;
+    /* number of consecutive failures, only counted if max_fails is
+       non-zero */
+    Py_ssize_t nfail;
+} GuardState;
+
+/* Header common to all fat guards: state must follow base */
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+} GuardObject;
+
+/* max_fails of new guards */
+static Py_ssize_t default_max_fails = 0;
+
+#ifndef FAT_NO_STATS
+static GuardStats guard_arg_type_stats;
+static GuardStats guard_arg_types_stats;
+static GuardStats guard_arg_value_stats;
+static GuardStats guard_arg_int_range_stats;
+static GuardStats guard_func_stats;
+static GuardStats guard_cell_stats;
+static GuardStats guard_type_stats;
+static GuardStats guard_instance_shape_stats;
+static GuardStats guard_dict_stats;
+static GuardStats guard_globals_stats;
+static GuardStats guard_builtins_stats;
+static GuardStats guard_module_attr_stats;
+#endif
+
+static int
+guard_check_result(PyObject *self, GuardStats *type_stats, int res)
+{
+    GuardState *state = &((GuardObject *)self)->state;
+
+    if (unlikely((res == 1 && state->max_fails != 0)
+                 || (res == 0 && state->nfail != 0))) {
+        if (res == 1)
+            state->nfail++;
+        if (state->max_fails != 0 && state->nfail >= state->max_fails) {
+            /* too many failures: give up on the specialization,
+               the guard now always fails */
+            res = 2;
+        }
+        else if (res == 0) {
+            state->nfail = 0;
+        }
+    }
+
+#ifndef FAT_NO_STATS
+    if (res == 0) {
+        state->stats.hit++;
+        type_stats->hit++;
+    }
+    else if (res == 1) {
+        state->stats.miss++;
+        type_stats->miss++;
+    }
+    else if (res == 2) {
+        state->stats.invalidate++;
+        type_stats->invalidate++;
+    }
+#endif
+    return res;
+}
+
+#ifndef FAT_NO_STATS
+#  define GUARD_CHECK_RESULT(self, type_stats, res) \
+    guard_check_result((self), &(type_stats), (res))
+#else
+#  define GUARD_CHECK_RESULT(self, type_stats, res) \
+    guard_check_result((self), NULL, (res))
+#endif
+
+static void
+guard_state_init(PyObject *self)
+{
+    GuardState *state = &((GuardObject *)self)->state;
+
+    state->max_fails = default_max_fails;
+}
+
+static PyObject*
+guard_get_max_fails(PyObject *self)
+{
+    return PyLong_FromSsize_t(((GuardObject *)self)->state.max_fails);
+}
+
+static int
+guard_set_max_fails(PyObject *self, PyObject *value)
+{
+    Py_ssize_t max_fails;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete max_fails");
+        return -1;
+    }
+
+    max_fails = PyLong_AsSsize_t(value);
+    if (max_fails == -1 && PyErr_Occurred())
+        return -1;
+    if (max_fails < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_fails must be >= 0");
+        return -1;
+    }
+
+    /* failures counted with the previous limit don't count */
+    ((GuardObject *)self)->state.max_fails = max_fails;
+    ((GuardObject *)self)->state.nfail = 0;
+    return 0;
+}
+
+#ifndef FAT_NO_STATS
+static PyObject*
+guard_stats_as_dict(GuardStats *stats)
+{
+    return Py_BuildValue("{snsnsn}",
+                         "hit", stats->hit,
+                         "miss", stats->miss,
+                         "invalidate", stats->invalidate);
+}
+
+static PyObject*
+guard_get_stats(PyObject *self)
+{
+    return guard_stats_as_dict(&((GuardObject *)self)->state.stats);
+}
+
+#  define GUARD_STATS_GETSET {"stats", (getter)guard_get_stats},
+#else
+#  define GUARD_STATS_GETSET
+#endif
+
+/* getters and setters common to all guards */
+#define GUARD_GETSET \
+    {"max_fails", (getter)guard_get_max_fails, (setter)guard_set_max_fails}, \
+    GUARD_STATS_GETSET
+
+
+/* Function arguments */
+
+/* Get the name of the parameter arg_index of func. Return a borrowed
+   reference to an interned string, or NULL if the argument cannot be
+   passed by keyword.
+
+   arg_index is the index of a positional argument: an index larger than or
+   equal to co_argcount is an item of the *args parameter, never a
+   keyword-only parameter. */
+static PyObject*
+get_parameter_name(PyObject *func, Py_ssize_t arg_index)
+{
+    PyCodeObject *code;
+
+    code = (PyCodeObject *)((PyFunctionObject *)func)->func_code;
+    if (arg_index >= code->co_argcount)
+        return NULL;
+
+    /* co_varnames strings are interned by PyCode_New() */
+    return PyTuple_GET_ITEM(code->co_varnames, arg_index);
+}
+
+/* Get the argument arg_index passed by position, or the argument passed
+   by keyword if arg_name is not NULL. Return a borrowed reference, or
+   NULL if the argument was not passed. */
+static PyObject*
+get_call_arg(PyObject **stack, Py_ssize_t nargs, PyObject *kwnames,
+             Py_ssize_t arg_index, PyObject *arg_name)
+{
+    Py_ssize_t nkwargs, i;
+
+    if (arg_index < nargs)
+        return stack[arg_index];
+
+    if (kwnames == NULL || arg_name == NULL)
+        return NULL;
+
+    /* keyword names of a call are interned strings: compare pointers,
+       a keyword which is not interned only skips the specialization */
+    nkwargs = PyTuple_GET_SIZE(kwnames);
+    for (i=0; i < nkwargs; i++) {
+        if (PyTuple_GET_ITEM(kwnames, i) == arg_name)
+            return stack[nargs + i];
+    }
+    return NULL;
+}
+
+/* Init hook of guards on an argument: set *parg_name to the name of the
+   parameter arg_index of func, to find the argument in keywords. Raise a
+   ValueError if *parg_name is already set to another name: the guard was
+   created or used for a function with a different parameter name.
+   Return 0 on success, or -1 on error. */
+static int
+bind_arg_name(PyObject *func, Py_ssize_t arg_index, PyObject **parg_name)
+{
+    PyObject *name;
+
+    name = get_parameter_name(func, arg_index);
+    if (name == NULL) {
+        /* *args parameter: the argument cannot be passed by keyword */
+        return 0;
+    }
+
+    if (*parg_name != NULL) {
+        if (*parg_name != name
+            && PyUnicode_Compare(*parg_name, name) != 0) {
+            if (PyErr_Occurred())
+                return -1;
+            PyErr_Format(PyExc_ValueError,
+                         "arg_name %R doesn't match the parameter name %R",
+                         *parg_name, name);
+            return -1;
+        }
+        return 0;
+    }
+
+    Py_INCREF(name);
+    PyUnicode_InternInPlace(&name);
+    *parg_name = name;
+    return 0;
+}
+
+
 /* GuardArgType */
 
+/* Number of entries of the cache of subclass checks */
+#define ARG_TYPE_CACHE_SIZE 4
+
+typedef struct {
+    /* strong reference, NULL if the entry is unused */
+    PyTypeObject *type;
+    /* tp_version_tag of type when the check was done */
+    unsigned int version_tag;
+    /* result of the check: 0 if type is a subclass of arg_types, 1 if not */
+    int res;
+} GuardArgTypeCacheEntry;
+
 typedef struct {
     PyFuncGuardObject base;
+    GuardState state;
     Py_ssize_t arg_index;
+    /* interned parameter name used to find the argument in keywords,
+       or NULL if the argument can only be passed by position */
+    PyObject *arg_name;
     Py_ssize_t nb_arg_type;
     PyObject** arg_types;
+    /* open addressing hash table of arg_types (borrowed references),
+       NULL if there are less than ARG_TYPE_TABLE_MIN types */
+    PyObject** type_table;
+    size_t type_table_mask;
+    /* if non-zero, accept subclasses of arg_types */
+    char subclasses;
+    /* recent subclass checks, replaced in round-robin */
+    GuardArgTypeCacheEntry type_cache[ARG_TYPE_CACHE_SIZE];
+    int type_cache_next;
 } GuardArgTypeObject;
 
+/* Minimum number of types to use a hash table instead of a linear search */
+#define ARG_TYPE_TABLE_MIN 4
+
+static size_t
+arg_type_hash(PyObject *type)
+{
+    /* type objects are aligned on at least 8 bytes */
+    size_t y = (size_t)type;
+    return (y >> 4) ^ (y >> 10);
+}
+
+/* Create the hash table of arg_types: the table size is at least twice
+   the number of types, so a lookup stops at an empty slot */
+static PyObject**
+arg_type_table_new(PyObject **arg_types, Py_ssize_t nb_arg_type,
+                   size_t *mask)
+{
+    PyObject **table;
+    size_t size = 8;
+    Py_ssize_t i;
+
+    while (size < (size_t)nb_arg_type * 2) {
+        if (size > PY_SSIZE_T_MAX / sizeof(table[0]) / 2) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        size *= 2;
+    }
+
+    table = PyMem_Calloc(size, sizeof(table[0]));
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (i=0; i < nb_arg_type; i++) {
+        PyObject *type = arg_types[i];
+        size_t j = arg_type_hash(type) & (size - 1);
+
+        while (table[j] != NULL && table[j] != type)
+            j = (j + 1) & (size - 1);
+        table[j] = type;
+    }
+
+    *mask = size - 1;
+    return table;
+}
+
 static int
-guard_arg_type_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_arg_type_init_guard(PyObject *self, PyObject *func)
 {
     GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
-    PyObject *arg;
-    PyTypeObject *type;
+
+    return bind_arg_name(func, guard->arg_index, &guard->arg_name);
+}
+
+/* Return 1 if type is one of arg_types, 0 otherwise */
+static int
+arg_type_match(GuardArgTypeObject *guard, PyTypeObject *type)
+{
     Py_ssize_t i;
-    int res;
 
-    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0) {
-        /* FIXME: implement keywords */
-        return 1;
+    if (guard->type_table != NULL) {
+        size_t mask = guard->type_table_mask;
+        size_t j = arg_type_hash((PyObject *)type) & mask;
+
+        while (1) {
+            PyObject *entry = guard->type_table[j];
+            if (entry == (PyObject *)type)
+                return 1;
+            if (entry == NULL)
+                return 0;
+            j = (j + 1) & mask;
+        }
     }
 
-    if (guard->arg_index >= nargs)
-        return 1;
+    for (i=0; i<guard->nb_arg_type; i++) {
+        if (guard->arg_types[i] == (PyObject *)type)
+            return 1;
+    }
+    return 0;
+}
 
-    arg = stack[guard->arg_index];
-    type = Py_TYPE(arg);
+/* Check if type is a subclass of one of arg_types. The result is cached
+   while the version tag of type is unchanged: modifying the bases of a
+   type invalidates its tag and the tags of its subclasses. */
+static int
+check_arg_subclass(GuardArgTypeObject *guard, PyTypeObject *type)
+{
+    _Py_IDENTIFIER(__class__);
+    GuardArgTypeCacheEntry *entry = NULL;
+    Py_ssize_t i;
+    int res;
+
+    for (i=0; i < ARG_TYPE_CACHE_SIZE; i++) {
+        if (guard->type_cache[i].type == type) {
+            entry = &guard->type_cache[i];
+            if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)
+                && type->tp_version_tag == entry->version_tag)
+                return entry->res;
+            /* outdated entry */
+            break;
+        }
+    }
 
+    /* walk the MRO */
     res = 1;
-    for (i=0; i<guard->nb_arg_type; i++) {
-        if (guard->arg_types[i] == (PyObject *)type) {
+    for (i=0; i < guard->nb_arg_type; i++) {
+        if (PyType_IsSubtype(type, (PyTypeObject *)guard->arg_types[i])) {
             res = 0;
             break;
         }
     }
 
+    /* a lookup in the method cache assigns a version tag to the type */
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG))
+        (void)_PyType_LookupId(type, &PyId___class__);
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        /* the result cannot be cached */
+        return res;
+    }
+
+    if (entry == NULL) {
+        entry = &guard->type_cache[guard->type_cache_next];
+        guard->type_cache_next = (guard->type_cache_next + 1)
+                                 % ARG_TYPE_CACHE_SIZE;
+        Py_INCREF(type);
+        Py_XSETREF(entry->type, type);
+    }
+    entry->version_tag = type->tp_version_tag;
+    entry->res = res;
     return res;
 }
 
+static int
+check_arg_type_guard(GuardArgTypeObject *guard,
+                     PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *arg;
+    PyTypeObject *type;
+
+    arg = get_call_arg(stack, nargs, kwnames,
+                       guard->arg_index, guard->arg_name);
+    if (arg == NULL)
+        return 1;
+    type = Py_TYPE(arg);
+
+    if (arg_type_match(guard, type))
+        return 0;
+    if (guard->subclasses)
+        return check_arg_subclass(guard, type);
+    return 1;
+}
+
+static int
+guard_arg_type_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_arg_type_guard((GuardArgTypeObject *)self,
+                                   stack, nargs, kwnames);
+    return GUARD_CHECK_RESULT(self, guard_arg_type_stats, res);
+}
+
 static void
 guard_arg_type_dealloc(GuardArgTypeObject *self)
 {
     GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
     Py_ssize_t i;
 
+    Py_CLEAR(guard->arg_name);
     for (i=0; i < guard->nb_arg_type; i++)
         Py_CLEAR(guard->arg_types[i]);
     PyMem_Free(guard->arg_types);
+    PyMem_Free(guard->type_table);
+    for (i=0; i < ARG_TYPE_CACHE_SIZE; i++)
+        Py_CLEAR(guard->type_cache[i].type);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
@@ -72,8 +476,11 @@ guard_arg_type_traverse(GuardArgTypeObject *self, visitproc visit, void *arg)
     GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
     Py_ssize_t i;
 
+    Py_VISIT(guard->arg_name);
     for (i=0; i < guard->nb_arg_type; i++)
         Py_VISIT(guard->arg_types[i]);
+    for (i=0; i < ARG_TYPE_CACHE_SIZE; i++)
+        Py_VISIT(guard->type_cache[i].type);
     return 0;
 }
 
@@ -88,10 +495,18 @@ guard_arg_type_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         return NULL;
 
     self = (GuardArgTypeObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_arg_type_init_guard;
     self->base.check = guard_arg_type_check;
     self->arg_index = 0;
+    self->arg_name = NULL;
     self->nb_arg_type = 0;
     self->arg_types = NULL;
+    self->type_table = NULL;
+    self->type_table_mask = 0;
+    self->subclasses = 0;
+    memset(self->type_cache, 0, sizeof(self->type_cache));
+    self->type_cache_next = 0;
 
     return op;
 }
@@ -100,17 +515,30 @@ static int
 guard_arg_type_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
     GuardArgTypeObject *self = (GuardArgTypeObject *)op;
-    static char *keywords[] = {"arg_index", "arg_types", NULL};
+    static char *keywords[] = {"arg_index", "arg_types", "arg_name",
+                               "subclasses", NULL};
     int arg_index;
+    int subclasses = 0;
     PyObject *arg_types_obj;
+    PyObject *arg_name = NULL;
     PyObject *seq = NULL;
     int nb_arg_type = 0;
     PyObject** arg_types = NULL;
+    PyObject** type_table = NULL;
+    size_t type_table_mask = 0;
     Py_ssize_t n, i;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO:GuardArgType", keywords,
-                                     &arg_index, &arg_types_obj))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|O!p:GuardArgType",
+                                     keywords,
+                                     &arg_index, &arg_types_obj,
+                                     &PyUnicode_Type, &arg_name,
+                                     &subclasses))
+        return -1;
+
+    if (arg_index < 0) {
+        PyErr_SetString(PyExc_ValueError, "arg_index must be >= 0");
         return -1;
+    }
 
     seq = PySequence_Fast(arg_types_obj, "arg_types must be a type or an iterable");
     if (seq == NULL)
@@ -149,9 +577,30 @@ guard_arg_type_init(PyObject *op, PyObject *args, PyObject *kwargs)
 
     Py_CLEAR(seq);
 
+    if (nb_arg_type >= ARG_TYPE_TABLE_MIN) {
+        type_table = arg_type_table_new(arg_types, nb_arg_type,
+                                        &type_table_mask);
+        if (type_table == NULL)
+            goto error;
+    }
+
+    if (arg_name != NULL) {
+        /* Intern the name to compare keyword names by pointer */
+        Py_INCREF(arg_name);
+        PyUnicode_InternInPlace(&arg_name);
+    }
+
     self->arg_index = arg_index;
+    Py_XSETREF(self->arg_name, arg_name);
     self->nb_arg_type = nb_arg_type;
     self->arg_types = arg_types;
+    PyMem_Free(self->type_table);
+    self->type_table = type_table;
+    self->type_table_mask = type_table_mask;
+    self->subclasses = (char)subclasses;
+    for (i=0; i < ARG_TYPE_CACHE_SIZE; i++)
+        Py_CLEAR(self->type_cache[i].type);
+    self->type_cache_next = 0;
     return 0;
 
 error:
@@ -182,12 +631,17 @@ guard_arg_type_get_arg_types(GuardArgTypeObject *self)
 
 static PyGetSetDef guard_arg_type_getsetlist[] = {
     {"arg_types", (getter)guard_arg_type_get_arg_types},
+    GUARD_GETSET
     {NULL} /* Sentinel */
 };
 
 static PyMemberDef guard_arg_type_members[] = {
     {"arg_index",   T_INT,   offsetof(GuardArgTypeObject, arg_index),
      RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardArgTypeObject, arg_name),
+     RESTRICTED|READONLY},
+    {"subclasses",   T_BOOL,   offsetof(GuardArgTypeObject, subclasses),
+     RESTRICTED|READONLY},
     {NULL}  /* Sentinel */
 };
 
@@ -234,126 +688,314 @@ static PyTypeObject GuardArgType_Type = {
 };
 
 
-/* GuardFunc */
+/* GuardArgTypes */
+
+typedef struct {
+    Py_ssize_t arg_index;
+    /* interned parameter name, or NULL if unknown */
+    PyObject *arg_name;
+    /* accepted types of the argument: types[start:start+ntype] */
+    Py_ssize_t start;
+    Py_ssize_t ntype;
+} GuardArgTypesItem;
 
 typedef struct {
     PyFuncGuardObject base;
-    PyObject *func;
-    PyObject *code;
-} GuardFuncObject;
+    GuardState state;
+    Py_ssize_t narg;
+    GuardArgTypesItem *args;
+    /* types of all arguments, laid out contiguously */
+    Py_ssize_t ntype;
+    PyObject **types;
+} GuardArgTypesObject;
 
 static int
-guard_func_init_guard(PyObject *self, PyObject *func)
+guard_arg_types_init_guard(PyObject *self, PyObject *func)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    GuardArgTypesObject *guard = (GuardArgTypesObject *)self;
+    Py_ssize_t i;
 
-    if ((PyObject *)func == guard->func) {
-        /* Replacing the code object of a function already removes its
-         * specialized code, no need to add a guard */
-        PyErr_SetString(PyExc_ValueError,
-                        "useless GuardFunc, a function already watch itself");
-        return -1;
+    for (i=0; i < guard->narg; i++) {
+        GuardArgTypesItem *item = &guard->args[i];
+
+        if (bind_arg_name(func, item->arg_index, &item->arg_name) < 0)
+            return -1;
     }
     return 0;
 }
 
 static int
-guard_func_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+check_arg_types_guard(GuardArgTypesObject *guard,
+                      PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
-    PyFunctionObject *func;
+    Py_ssize_t i, j;
 
-    assert(Py_TYPE(guard->func) == &PyFunction_Type);
-    func = (PyFunctionObject *)guard->func;
+    for (i=0; i < guard->narg; i++) {
+        GuardArgTypesItem *item = &guard->args[i];
+        PyObject **types;
+        PyObject *arg;
 
-    if (((PyFunctionObject *)func)->func_code != guard->code)
-        return 2;
+        arg = get_call_arg(stack, nargs, kwnames,
+                           item->arg_index, item->arg_name);
+        if (arg == NULL)
+            return 1;
+
+        types = &guard->types[item->start];
+        for (j=0; j < item->ntype; j++) {
+            if (types[j] == (PyObject *)Py_TYPE(arg))
+                break;
+        }
+        if (j == item->ntype)
+            return 1;
+    }
 
     return 0;
 }
 
+static int
+guard_arg_types_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_arg_types_guard((GuardArgTypesObject *)self,
+                                    stack, nargs, kwnames);
+    return GUARD_CHECK_RESULT(self, guard_arg_types_stats, res);
+}
+
 static void
-guard_func_dealloc(GuardFuncObject *self)
+guard_arg_types_clear(GuardArgTypesObject *guard)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    Py_ssize_t i;
 
-    Py_XDECREF(guard->func);
-    Py_XDECREF(guard->code);
+    for (i=0; i < guard->narg; i++)
+        Py_CLEAR(guard->args[i].arg_name);
+    for (i=0; i < guard->ntype; i++)
+        Py_CLEAR(guard->types[i]);
+    PyMem_Free(guard->args);
+    PyMem_Free(guard->types);
+    guard->narg = 0;
+    guard->args = NULL;
+    guard->ntype = 0;
+    guard->types = NULL;
+}
+
+static void
+guard_arg_types_dealloc(GuardArgTypesObject *self)
+{
+    guard_arg_types_clear(self);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
 
 static int
-guard_func_traverse(GuardFuncObject *self, visitproc visit, void *arg)
+guard_arg_types_traverse(GuardArgTypesObject *guard, visitproc visit, void *arg)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    Py_ssize_t i;
 
-    Py_VISIT(guard->func);
-    Py_VISIT(guard->code);
+    for (i=0; i < guard->narg; i++)
+        Py_VISIT(guard->args[i].arg_name);
+    for (i=0; i < guard->ntype; i++)
+        Py_VISIT(guard->types[i]);
     return 0;
 }
 
 static PyObject *
-guard_func_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_arg_types_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardFuncObject *self;
+    GuardArgTypesObject *self;
 
     op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardFuncObject *)op;
-    self->base.init = guard_func_init_guard;
-    self->base.check = guard_func_check;
-    self->func = NULL;
-    self->code = NULL;
+    self = (GuardArgTypesObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_arg_types_init_guard;
+    self->base.check = guard_arg_types_check;
+    self->narg = 0;
+    self->args = NULL;
+    self->ntype = 0;
+    self->types = NULL;
 
     return op;
 }
 
 static int
-guard_func_init(PyObject *op, PyObject *args, PyObject *kwargs)
+guard_arg_types_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    GuardFuncObject *self = (GuardFuncObject *)op;
-    static char *keywords[] = {"func", NULL};
-    PyObject *func;
-    PyObject *code;
+    GuardArgTypesObject *self = (GuardArgTypesObject *)op;
+    static char *keywords[] = {"arg_types", NULL};
+    PyObject *arg_types_obj;
+    PyObject *seq = NULL, *types_seq = NULL;
+    Py_ssize_t narg, ntype = 0, i, j;
+    GuardArgTypesItem *items = NULL;
+    PyObject **types = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardFunc", keywords,
-                                     &func))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardArgTypes",
+                                     keywords, &arg_types_obj))
         return -1;
 
-    if (!PyFunction_Check(func)) {
-        PyErr_Format(PyExc_TypeError,
-                     "func must be a function, not %s",
-                     Py_TYPE(func)->tp_name);
-        return -1;
+    seq = PySequence_Fast(arg_types_obj,
+                          "arg_types must be an iterable of "
+                          "(arg_index, types) tuples");
+    if (seq == NULL)
+        goto error;
+
+    narg = PySequence_Fast_GET_SIZE(seq);
+    if (narg == 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "need at least one argument");
+        goto error;
+    }
+    if (narg >= PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(items[0])) {
+        PyErr_NoMemory();
+        goto error;
     }
 
-    code = ((PyFunctionObject*)func)->func_code;
+    items = PyMem_Malloc(narg * sizeof(items[0]));
+    if (items == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
 
-    Py_INCREF(func);
-    self->func = func;
-    Py_INCREF(code);
-    self->code = code;
+    for (i=0; i < narg; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        Py_ssize_t arg_index, n;
+        PyObject **new_types;
+
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_Format(PyExc_TypeError,
+                         "arg_types item must be a (arg_index, types) tuple, "
+                         "got %s",
+                         Py_TYPE(item)->tp_name);
+            goto error;
+        }
+
+        arg_index = PyLong_AsSsize_t(PyTuple_GET_ITEM(item, 0));
+        if (arg_index == -1 && PyErr_Occurred())
+            goto error;
+        if (arg_index < 0) {
+            PyErr_SetString(PyExc_ValueError, "arg_index must be >= 0");
+            goto error;
+        }
+
+        types_seq = PySequence_Fast(PyTuple_GET_ITEM(item, 1),
+                                    "types must be an iterable");
+        if (types_seq == NULL)
+            goto error;
+
+        n = PySequence_Fast_GET_SIZE(types_seq);
+        if (n == 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "need at least one argument type");
+            goto error;
+        }
+        if (n >= PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(types[0]) - ntype) {
+            PyErr_NoMemory();
+            goto error;
+        }
+
+        new_types = PyMem_Realloc(types, (ntype + n) * sizeof(types[0]));
+        if (new_types == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        types = new_types;
+
+        items[i].arg_index = arg_index;
+        items[i].arg_name = NULL;
+        items[i].start = ntype;
+        items[i].ntype = n;
+
+        for (j=0; j < n; j++) {
+            PyObject *type = PySequence_Fast_GET_ITEM(types_seq, j);
+            if (!PyType_Check(type)) {
+                PyErr_Format(PyExc_TypeError,
+                             "arg_type must be a type, got %s",
+                             Py_TYPE(type)->tp_name);
+                goto error;
+            }
+
+            Py_INCREF(type);
+            types[ntype] = type;
+            ntype++;
+        }
+        Py_CLEAR(types_seq);
+    }
+
+    Py_CLEAR(seq);
+
+    guard_arg_types_clear(self);
+    self->narg = narg;
+    self->args = items;
+    self->ntype = ntype;
+    self->types = types;
     return 0;
+
+error:
+    for (i=0; i < ntype; i++)
+        Py_DECREF(types[i]);
+    PyMem_Free(types);
+    PyMem_Free(items);
+    Py_XDECREF(types_seq);
+    Py_XDECREF(seq);
+    return -1;
 }
 
-static PyMemberDef guard_func_members[] = {
-    {"func",   T_OBJECT,   offsetof(GuardFuncObject, func),
-     RESTRICTED|READONLY},
-    {"code",   T_OBJECT,   offsetof(GuardFuncObject, code),
-     RESTRICTED|READONLY},
-    {NULL}  /* Sentinel */
+static PyObject*
+guard_arg_types_get_arg_types(GuardArgTypesObject *self)
+{
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyTuple_New(self->narg);
+    if (list == NULL)
+        return NULL;
+
+    for (i=0; i < self->narg; i++) {
+        GuardArgTypesItem *item = &self->args[i];
+        PyObject *types, *pair;
+        Py_ssize_t j;
+
+        types = PyTuple_New(item->ntype);
+        if (types == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        for (j=0; j < item->ntype; j++) {
+            PyObject *type = self->types[item->start + j];
+            Py_INCREF(type);
+            PyTuple_SET_ITEM(types, j, type);
+        }
+
+        pair = Py_BuildValue("(nN)", item->arg_index, types);
+        if (pair == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(list, i, pair);
+    }
+    return list;
+}
+
+static PyGetSetDef guard_arg_types_getsetlist[] = {
+    {"arg_types", (getter)guard_arg_types_get_arg_types},
+    GUARD_GETSET
+    {NULL} /* Sentinel */
 };
 
-static PyTypeObject GuardFunc_Type = {
+PyDoc_STRVAR(guard_arg_types_doc,
+"GuardArgTypes(arg_types)\n"
+"\n"
+"Guard on the types of many arguments: arg_types is an iterable of\n"
+"(arg_index, types) tuples. The type of each argument must be one of\n"
+"its types.");
+
+static PyTypeObject GuardArgTypes_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardFunc",
-    sizeof(GuardFuncObject),
+    "fat.GuardArgTypes",
+    sizeof(GuardArgTypesObject),
     0,
-    (destructor)guard_func_dealloc,             /* tp_dealloc */
+    (destructor)guard_arg_types_dealloc,        /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -369,302 +1011,331 @@ static PyTypeObject GuardFunc_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_func_traverse,          /* tp_traverse */
+    guard_arg_types_doc,                        /* tp_doc */
+    (traverseproc)guard_arg_types_traverse,     /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    guard_func_members,                         /* tp_members */
-    0,                                          /* tp_getset */
-    &PyFuncGuard_Type,                      /* tp_base */
+    0,                                          /* tp_members */
+    guard_arg_types_getsetlist,                 /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_func_init,                            /* tp_init */
+    guard_arg_types_init,                       /* tp_init */
     0,                                          /* tp_alloc */
-    guard_func_new,                             /* tp_new */
+    guard_arg_types_new,                        /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardDict */
-
-typedef struct {
-    PyObject *key;
-    PyObject *value;
-} GuardDictPair;
+/* GuardArgValue */
 
 typedef struct {
     PyFuncGuardObject base;
-    PyObject *dict;
-    PY_UINT64_T dict_version;
-    Py_ssize_t npair;
-    GuardDictPair *pairs;
-} GuardDictObject;
+    GuardState state;
+    Py_ssize_t arg_index;
+    /* interned parameter name, set by the init hook, or NULL if the
+       argument can only be passed by position */
+    PyObject *arg_name;
+    /* tuple of accepted values, compared by identity (and str by value) */
+    PyObject *values;
+    /* function specialized with the guard to read the default value of
+       an omitted argument, Py_None if the guard is used by many functions,
+       or NULL */
+    PyObject *func;
+} GuardArgValueObject;
 
-static void
-guard_dict_pair_dealloc(GuardDictPair *pair)
+static int
+guard_arg_value_init_guard(PyObject *self, PyObject *func)
 {
-    Py_CLEAR(pair->key);
-    Py_CLEAR(pair->value);
+    GuardArgValueObject *guard = (GuardArgValueObject *)self;
+
+    if (bind_arg_name(func, guard->arg_index, &guard->arg_name) < 0)
+        return -1;
+
+    if (guard->func == NULL) {
+        Py_INCREF(func);
+        guard->func = func;
+    }
+    else if (guard->func != func) {
+        /* functions can have different default values */
+        Py_INCREF(Py_None);
+        Py_SETREF(guard->func, Py_None);
+    }
+    return 0;
 }
 
-static void
-guard_dict_clear(GuardDictObject *guard)
+/* Compare two ready str by value, without allocating memory */
+static int
+arg_value_str_equal(PyObject *str1, PyObject *str2)
 {
-    Py_ssize_t i;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(str1);
 
-    Py_CLEAR(guard->dict);
-    for (i=0; i < guard->npair; i++)
-        guard_dict_pair_dealloc(&guard->pairs[i]);
-    guard->npair = 0;
-    PyMem_Free(guard->pairs);
-    guard->pairs = NULL;
+    return (len == PyUnicode_GET_LENGTH(str2)
+            && PyUnicode_KIND(str1) == PyUnicode_KIND(str2)
+            && memcmp(PyUnicode_DATA(str1), PyUnicode_DATA(str2),
+                      len * PyUnicode_KIND(str1)) == 0);
 }
 
-static int
-check_dict_pair_guard(PyObject *dict, GuardDictPair *pair)
+/* Get the current default value of the omitted argument: func_defaults is
+   read at each check, so a modification of __defaults__ is seen. Return a
+   borrowed reference, or NULL if the default value is unknown. */
+static PyObject*
+arg_value_get_default(GuardArgValueObject *guard, PyObject *kwnames)
 {
-    PyObject *current_value;
+    PyFunctionObject *func;
+    PyCodeObject *code;
+    PyObject *defaults;
+    Py_ssize_t first, i;
 
-    /* FIXME: Use PyDict_GetItem? */
-    current_value = PyObject_GetItem(dict, pair->key);
-    if (current_value == NULL && PyErr_Occurred()) {
-        if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
-            /* lookup faileds */
-            return -1;
-        }
-        /* key doesn't exist */
-        PyErr_Clear();
-    }
+    if (guard->func == NULL || !PyFunction_Check(guard->func))
+        return NULL;
 
-    /* we only care of the value pointer, not its content,
-       so it is safe to use the pointer after Py_DECREF */
-    Py_XDECREF(current_value);
+    if (kwnames != NULL) {
+        /* a keyword name which is not interned was not found by
+           get_call_arg() */
+        for (i=0; i < PyTuple_GET_SIZE(kwnames); i++) {
+            PyObject *name = PyTuple_GET_ITEM(kwnames, i);
 
-    if (current_value == pair->value) {
-        /* another key was modified, but the watched key is unchanged */
-        return 0;
+            if (guard->arg_name == NULL
+                || !PyUnicode_IS_READY(name)
+                || arg_value_str_equal(name, guard->arg_name))
+                return NULL;
+        }
     }
 
-    /* the key was modified (removed or new value) */
-    return 2;
+    func = (PyFunctionObject *)guard->func;
+    code = (PyCodeObject *)func->func_code;
+    defaults = func->func_defaults;
+    if (defaults == NULL || guard->arg_index >= code->co_argcount)
+        return NULL;
+
+    first = code->co_argcount - PyTuple_GET_SIZE(defaults);
+    if (guard->arg_index < first)
+        return NULL;
+    return PyTuple_GET_ITEM(defaults, guard->arg_index - first);
 }
 
 static int
-guard_dict_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+check_arg_value_guard(GuardArgValueObject *guard,
+                      PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardDictObject *guard = (GuardDictObject *)self;
-    PY_UINT64_T dict_version;
-    PyObject *dict;
-    Py_ssize_t i;
+    PyObject *arg;
+    Py_ssize_t i, size;
 
-    dict = guard->dict;
-    assert(PyDict_Check(dict));
+    arg = get_call_arg(stack, nargs, kwnames,
+                       guard->arg_index, guard->arg_name);
+    if (arg == NULL) {
+        arg = arg_value_get_default(guard, kwnames);
+        if (arg == NULL)
+            return 1;
+    }
 
-    dict_version = (((PyDictObject*)(dict))->ma_version_tag);
-    if (unlikely(dict_version != guard->dict_version)) {
-        assert(guard->npair >= 1);
+    size = PyTuple_GET_SIZE(guard->values);
+    for (i=0; i < size; i++) {
+        if (PyTuple_GET_ITEM(guard->values, i) == arg)
+            return 0;
+    }
 
-        for (i=0; i < guard->npair; i++) {
-            int res = check_dict_pair_guard(dict, &guard->pairs[i]);
-            if (res)
-                return res;
-        }
+    /* slow-path: str which is not interned, like a str built at runtime
+       or a constant which is not an identifier ('utf-8') */
+    if (PyUnicode_CheckExact(arg) && PyUnicode_IS_READY(arg)) {
+        for (i=0; i < size; i++) {
+            PyObject *value = PyTuple_GET_ITEM(guard->values, i);
 
-        guard->dict_version = dict_version;
+            if (PyUnicode_CheckExact(value)
+                && arg_value_str_equal(arg, value))
+                return 0;
+        }
     }
+    return 1;
+}
 
-    return 0;
+static int
+guard_arg_value_check(PyObject *self, PyObject **stack, Py_ssize_t nargs,
+                      PyObject *kwnames)
+{
+    int res = check_arg_value_guard((GuardArgValueObject *)self,
+                                    stack, nargs, kwnames);
+    return GUARD_CHECK_RESULT(self, guard_arg_value_stats, res);
 }
 
 static void
-guard_dict_dealloc(GuardDictObject *self)
+guard_arg_value_dealloc(GuardArgValueObject *self)
 {
-    guard_dict_clear(self);
+    Py_CLEAR(self->arg_name);
+    Py_CLEAR(self->values);
+    Py_CLEAR(self->func);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
 
 static int
-guard_dict_traverse(GuardDictObject *guard, visitproc visit, void *arg)
+guard_arg_value_traverse(GuardArgValueObject *self, visitproc visit,
+                         void *arg)
 {
-    Py_ssize_t i;
-
-    Py_VISIT(guard->dict);
-    for (i=0; i < guard->npair; i++) {
-        Py_VISIT(guard->pairs[i].key);
-        Py_VISIT(guard->pairs[i].value);
-    }
+    Py_VISIT(self->arg_name);
+    Py_VISIT(self->values);
+    Py_VISIT(self->func);
     return 0;
 }
 
 static PyObject *
-guard_dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_arg_value_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardDictObject *self;
+    GuardArgValueObject *self;
 
     op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardDictObject *)op;
-    self->base.check = guard_dict_check;
-    self->dict = NULL;
-    self->dict_version = 0;
-    self->npair = 0;
-    self->pairs = NULL;
+    self = (GuardArgValueObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_arg_value_init_guard;
+    self->base.check = guard_arg_value_check;
+    self->arg_index = 0;
+    self->arg_name = NULL;
+    self->values = NULL;
+    self->func = NULL;
+
     return op;
 }
 
-static int
-guard_dict_init_keys(PyObject *op, PyObject *dict,
-                     Py_ssize_t first_key, PyObject *keys)
+/* Range of small ints cached by CPython (NSMALLNEGINTS and NSMALLPOSINTS
+   of Objects/longobject.c) */
+#define SMALL_INT_MIN (-5)
+#define SMALL_INT_MAX 256
+
+/* Get the object which is the only instance of value: value if it is a
+   singleton, the cached small int, or the interned str. Return a new
+   reference, or NULL if value cannot be compared by identity. */
+static PyObject*
+arg_value_canonical(PyObject *value)
 {
-    GuardDictObject *self = (GuardDictObject *)op;
-    GuardDictPair *pairs = NULL;
-    Py_ssize_t nkeys, i, npair = 0;
+    if (value == Py_None || value == Py_True || value == Py_False
+        || value == Py_Ellipsis || value == Py_NotImplemented) {
+        Py_INCREF(value);
+        return value;
+    }
 
-    /* FIXME: PyDict_CheckExact(dict)? */
+    if (PyLong_CheckExact(value)) {
+        int overflow;
+        long x = PyLong_AsLongAndOverflow(value, &overflow);
 
-    if (!PyTuple_Check(keys)) {
-        PyErr_Format(PyExc_TypeError,
-                     "keys must be a tuple of str, not %s",
-                     Py_TYPE(keys)->tp_name);
-        goto error;
+        if (x == -1 && PyErr_Occurred())
+            return NULL;
+        if (!overflow && SMALL_INT_MIN <= x && x <= SMALL_INT_MAX) {
+            /* get the cached object */
+            return PyLong_FromLong(x);
+        }
     }
-
-    nkeys = PyTuple_GET_SIZE(keys);
-    if ((nkeys - first_key) <= 0) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keys must at least contain one key");
-        goto error;
+    else if (PyUnicode_CheckExact(value)) {
+        Py_INCREF(value);
+        PyUnicode_InternInPlace(&value);
+        return value;
     }
 
-    if (nkeys >  PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(GuardDictPair)) {
-        PyErr_NoMemory();
-        goto error;
+    PyErr_Format(PyExc_TypeError,
+                 "value must be None, a bool, a small int or a str, "
+                 "not %R", value);
+    return NULL;
+}
+
+static int
+guard_arg_value_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardArgValueObject *self = (GuardArgValueObject *)op;
+    static char *keywords[] = {"arg_index", "values", NULL};
+    Py_ssize_t arg_index;
+    PyObject *values_obj, *seq, *values = NULL;
+    Py_ssize_t n, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nO:GuardArgValue",
+                                     keywords,
+                                     &arg_index, &values_obj))
+        return -1;
+
+    if (arg_index < 0) {
+        PyErr_SetString(PyExc_ValueError, "arg_index must be >= 0");
+        return -1;
     }
-    pairs = PyMem_Malloc(sizeof(GuardDictPair) * nkeys);
-    if (pairs == NULL) {
-        PyErr_NoMemory();
+
+    seq = PySequence_Fast(values_obj, "values must be an iterable");
+    if (seq == NULL)
+        return -1;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0) {
+        PyErr_SetString(PyExc_ValueError, "need at least one value");
         goto error;
     }
 
-    for (i=first_key; i < nkeys; i++) {
-        PyObject *key, *value;
+    values = PyTuple_New(n);
+    if (values == NULL)
+        goto error;
 
-        key = PyTuple_GET_ITEM(keys, i);
+    for (i=0; i < n; i++) {
+        PyObject *value;
 
-        if (!PyUnicode_Check(key)) {
-            PyErr_Format(PyExc_TypeError,
-                         "key must be str, not %s",
-                         Py_TYPE(key)->tp_name);
+        value = arg_value_canonical(PySequence_Fast_GET_ITEM(seq, i));
+        if (value == NULL)
             goto error;
-        }
+        PyTuple_SET_ITEM(values, i, value);
+    }
+    Py_DECREF(seq);
 
-        /* Intern the key string */
-        Py_INCREF(key);
-        PyUnicode_InternInPlace(&key);
+    self->arg_index = arg_index;
+    Py_CLEAR(self->arg_name);
+    Py_CLEAR(self->func);
+    Py_XSETREF(self->values, values);
+    return 0;
 
-        value = PyObject_GetItem(dict, key);
-        if (value == NULL && PyErr_Occurred()) {
-            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
-                Py_DECREF(key);
-                goto error;
-            }
-            /* key doesn't exist */
-            PyErr_Clear();
-        }
+error:
+    Py_DECREF(seq);
+    Py_XDECREF(values);
+    return -1;
+}
 
-        pairs[npair].key = key;
-        pairs[npair].value = value;
-        npair++;
-    }
-
-    guard_dict_clear(self);
-
-    Py_INCREF(dict);
-    self->dict = dict;
-    self->dict_version = (((PyDictObject*)(dict))->ma_version_tag);
-    self->npair = npair;
-    self->pairs = pairs;
-    return 0;
-
-error:
-    for (i=0; i < npair; i++)
-        guard_dict_pair_dealloc(&pairs[i]);
-    PyMem_Free(pairs);
-    return -1;
-}
-
-static int
-guard_dict_init(PyObject *op, PyObject *args, PyObject *kwargs)
-{
-    PyObject *dict;
-
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
-        return -1;
-    }
-    assert(PyTuple_Check(args));
-    if (PyTuple_GET_SIZE(args) == 0) {
-        PyErr_SetString(PyExc_TypeError, "missing dict parameter");
-        return -1;
-    }
-    dict = PyTuple_GET_ITEM(args, 0);
-    if (!PyDict_Check(dict)) {
-        PyErr_Format(PyExc_TypeError,
-                     "dict parameter must be dict, got %s",
-                     Py_TYPE(dict)->tp_name);
-        return -1;
-    }
-
-    return guard_dict_init_keys(op, dict, 1, args);
-}
-
-static PyObject*
-guard_dict_get_keys(GuardDictObject *self)
-{
-    PyObject *tuple;
-    Py_ssize_t i;
-
-    tuple = PyTuple_New(self->npair);
-    if (tuple == NULL)
-        return NULL;
-
-    for (i=0; i < self->npair; i++) {
-        GuardDictPair *pair = &self->pairs[i];
-
-        Py_INCREF(pair->key);
-        PyTuple_SET_ITEM(tuple, i, pair->key);
-    }
-    return tuple;
-}
-
-static PyGetSetDef guard_dict_getsetlist[] = {
-    {"keys", (getter)guard_dict_get_keys},
+static PyGetSetDef guard_arg_value_getsetlist[] = {
+    GUARD_GETSET
     {NULL} /* Sentinel */
 };
 
-static PyMemberDef guard_dict_members[] = {
-    {"dict",   T_OBJECT,   offsetof(GuardDictObject, dict),
+static PyMemberDef guard_arg_value_members[] = {
+    {"arg_index", T_PYSSIZET, offsetof(GuardArgValueObject, arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name", T_OBJECT, offsetof(GuardArgValueObject, arg_name),
+     RESTRICTED|READONLY},
+    {"values", T_OBJECT, offsetof(GuardArgValueObject, values),
      RESTRICTED|READONLY},
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject GuardDict_Type = {
+PyDoc_STRVAR(guard_arg_value_doc,
+"GuardArgValue(arg_index, values)\n"
+"\n"
+"Guard on the value of the argument arg_index: the argument must be one\n"
+"of values. Values are compared by identity, so only None, bool, small\n"
+"ints, Ellipsis, NotImplemented and str are accepted; str values are\n"
+"interned, a str argument which is not interned is compared by value.\n"
+"\n"
+"If the argument is omitted, its current default value is checked. The\n"
+"default value is unknown (the specialization is skipped) if the guard\n"
+"was not used to specialize a function, or if it is used by many\n"
+"functions.");
+
+static PyTypeObject GuardArgValue_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardDict",
-    sizeof(GuardDictObject),
+    "fat.GuardArgValue",
+    sizeof(GuardArgValueObject),
     0,
-    (destructor)guard_dict_dealloc,             /* tp_dealloc */
+    (destructor)guard_arg_value_dealloc,        /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -680,101 +1351,205 @@ static PyTypeObject GuardDict_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    guard_arg_value_doc,                        /* tp_doc */
+    (traverseproc)guard_arg_value_traverse,     /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    guard_dict_members,                         /* tp_members */
-    guard_dict_getsetlist,                      /* tp_getset */
+    guard_arg_value_members,                    /* tp_members */
+    guard_arg_value_getsetlist,                 /* tp_getset */
     &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_dict_init,                            /* tp_init */
+    guard_arg_value_init,                       /* tp_init */
     0,                                          /* tp_alloc */
-    guard_dict_new,                             /* tp_new */
+    guard_arg_value_new,                        /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardGlobals */
+/* GuardArgIntRange */
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    Py_ssize_t arg_index;
+    /* interned parameter name, set by the init hook, or NULL if the
+       argument can only be passed by position */
+    PyObject *arg_name;
+    long long min;
+    long long max;
+} GuardArgIntRangeObject;
+
+/* Maximum number of digits of an int read directly: the absolute value
+   has at most INT_RANGE_MAX_DIGITS * PyLong_SHIFT bits (60 bits with
+   30-bit or 15-bit digits), so it fits into a long long */
+#define INT_RANGE_MAX_DIGITS (63 / PyLong_SHIFT)
 
 static int
-guard_globals_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_arg_int_range_init_guard(PyObject *self, PyObject *func)
 {
-    GuardDictObject *guard = (GuardDictObject *)self;
-    PyThreadState *tstate;
-    PyFrameObject *frame;
+    GuardArgIntRangeObject *guard = (GuardArgIntRangeObject *)self;
+
+    return bind_arg_name(func, guard->arg_index, &guard->arg_name);
+}
+
+static int
+check_arg_int_range_guard(GuardArgIntRangeObject *guard,
+                          PyObject **stack, Py_ssize_t nargs,
+                          PyObject *kwnames)
+{
+    PyObject *arg;
+    Py_ssize_t size, ndigits, i;
+    const digit *digits;
+    long long x;
 
-    tstate = PyThreadState_GET();
-    assert(tstate != NULL);
+    arg = get_call_arg(stack, nargs, kwnames,
+                       guard->arg_index, guard->arg_name);
+    if (arg == NULL || !PyLong_CheckExact(arg))
+        return 1;
 
-    frame = tstate->frame;
-    assert(frame != NULL);
+    /* read digits: no conversion, no memory allocation */
+    size = Py_SIZE(arg);
+    ndigits = Py_ABS(size);
+    digits = ((PyLongObject *)arg)->ob_digit;
+    if (ndigits <= 1) {
+        x = (ndigits == 0) ? 0 : (long long)digits[0];
+    }
+    else if (ndigits <= INT_RANGE_MAX_DIGITS) {
+        x = 0;
+        for (i=ndigits - 1; i >= 0; i--)
+            x = (x << PyLong_SHIFT) | digits[i];
+    }
+    else {
+        /* 2^60 or larger: rare, the conversion doesn't allocate */
+        int overflow;
 
-    /* If the frame globals dictionary is different than the frame globals
-     * dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_globals != guard->dict))
-        return 2;
+        x = PyLong_AsLongLongAndOverflow(arg, &overflow);
+        if (overflow)
+            return 1;
+        if (x < guard->min || x > guard->max)
+            return 1;
+        return 0;
+    }
+    if (size < 0)
+        x = -x;
+
+    if (x < guard->min || x > guard->max)
+        return 1;
+    return 0;
+}
+
+static int
+guard_arg_int_range_check(PyObject *self, PyObject **stack,
+                          Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_arg_int_range_guard((GuardArgIntRangeObject *)self,
+                                        stack, nargs, kwnames);
+    return GUARD_CHECK_RESULT(self, guard_arg_int_range_stats, res);
+}
+
+static void
+guard_arg_int_range_dealloc(GuardArgIntRangeObject *self)
+{
+    Py_CLEAR(self->arg_name);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
 
-    return guard_dict_check(self, stack, nargs, kwnames);
+static int
+guard_arg_int_range_traverse(GuardArgIntRangeObject *self, visitproc visit,
+                             void *arg)
+{
+    Py_VISIT(self->arg_name);
+    return 0;
 }
 
 static PyObject *
-guard_globals_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_arg_int_range_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardDictObject *self;
+    GuardArgIntRangeObject *self;
 
-    op = GuardDict_Type.tp_new(type, args, kwds);
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardDictObject *)op;
-    self->base.check = guard_globals_check;
+    self = (GuardArgIntRangeObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_arg_int_range_init_guard;
+    self->base.check = guard_arg_int_range_check;
+    self->arg_index = 0;
+    self->arg_name = NULL;
+    self->min = 0;
+    self->max = 0;
 
     return op;
 }
 
 static int
-guard_globals_init(PyObject *op, PyObject *args, PyObject *kwargs)
+guard_arg_int_range_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    PyObject *globals, *keys;
+    GuardArgIntRangeObject *self = (GuardArgIntRangeObject *)op;
+    static char *keywords[] = {"arg_index", "min", "max", NULL};
+    Py_ssize_t arg_index;
+    long long min, max;
 
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nLL:GuardArgIntRange",
+                                     keywords,
+                                     &arg_index, &min, &max))
         return -1;
-    }
-    keys = args;
 
-    globals = PyEval_GetGlobals();
-    if (globals == NULL) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "unable to get globals");
+    if (arg_index < 0) {
+        PyErr_SetString(PyExc_ValueError, "arg_index must be >= 0");
+        return -1;
+    }
+    if (min > max) {
+        PyErr_SetString(PyExc_ValueError, "min must be <= max");
         return -1;
     }
 
-    return guard_dict_init_keys(op, globals, 0, keys);
+    self->arg_index = arg_index;
+    Py_CLEAR(self->arg_name);
+    self->min = min;
+    self->max = max;
+    return 0;
 }
 
+static PyGetSetDef guard_arg_int_range_getsetlist[] = {
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
 
-PyDoc_STRVAR(guard_globals_doc,
-"GuardGlobals(keys)\n"
+static PyMemberDef guard_arg_int_range_members[] = {
+    {"arg_index", T_PYSSIZET, offsetof(GuardArgIntRangeObject, arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name", T_OBJECT, offsetof(GuardArgIntRangeObject, arg_name),
+     RESTRICTED|READONLY},
+    {"min", T_LONGLONG, offsetof(GuardArgIntRangeObject, min),
+     RESTRICTED|READONLY},
+    {"max", T_LONGLONG, offsetof(GuardArgIntRangeObject, max),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_arg_int_range_doc,
+"GuardArgIntRange(arg_index, min, max)\n"
 "\n"
-"Guard on globals()[key] for all keys.");
+"Guard on the argument arg_index: it must be an int (not a subclass)\n"
+"in the range [min; max]. min and max must fit into a C long long.");
 
-static PyTypeObject GuardGlobals_Type = {
+static PyTypeObject GuardArgIntRange_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardGlobals",
-    sizeof(GuardDictObject),
+    "fat.GuardArgIntRange",
+    sizeof(GuardArgIntRangeObject),
     0,
-    0,                                          /* tp_dealloc */
+    (destructor)guard_arg_int_range_dealloc,    /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -790,209 +1565,405 @@ static PyTypeObject GuardGlobals_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    guard_globals_doc,                          /* tp_doc */
-    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    guard_arg_int_range_doc,                    /* tp_doc */
+    (traverseproc)guard_arg_int_range_traverse, /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    &GuardDict_Type,                            /* tp_base */
+    guard_arg_int_range_members,                /* tp_members */
+    guard_arg_int_range_getsetlist,             /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_globals_init,                        /* tp_init */
+    guard_arg_int_range_init,                   /* tp_init */
     0,                                          /* tp_alloc */
-    guard_globals_new,                         /* tp_new */
+    guard_arg_int_range_new,                    /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardBuiltins */
+/* GuardFunc */
 
 typedef struct {
-    GuardDictObject base;
-    int init_failed;
-    PyObject *guard_globals;
-} GuardBuiltinsObject;
-
-static void
-guard_builtins_dealloc(GuardBuiltinsObject *self)
-{
-    Py_CLEAR(self->guard_globals);
-    guard_dict_dealloc(&self->base);
-}
+    PyFuncGuardObject base;
+    GuardState state;
+    PyObject *func;
+    PyObject *code;
+} GuardFuncObject;
 
 static int
-guard_builtins_init_guard(PyObject *self, PyObject *func)
+guard_func_init_guard(PyObject *self, PyObject *func)
 {
-    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
-    Py_ssize_t i;
-    PyObject *init_value;
-    GuardDictObject *globals_guard;
-
-    assert(init_builtins != NULL);
-    for (i=0; i < guard->base.npair; i++) {
-        PyObject *name = guard->base.pairs[i].key;
-
-        init_value = PyDict_GetItem(init_builtins, name);
-        if (init_value != NULL) {
-            if (guard->base.pairs[i].value != init_value) {
-                /* builtin was modified since Python initialization:
-                   don't specialize the function */
-                guard->init_failed = 1;
-                return 1;
-            }
-        }
-        PyErr_Clear();
-    }
+    GuardFuncObject *guard = (GuardFuncObject *)self;
 
-    globals_guard = (GuardDictObject *)guard->guard_globals;
-    for (i=0; i < globals_guard->npair; i++) {
-        if (globals_guard->pairs[i].value != NULL) {
-            /* if name already exists in global, the guard must fail */
-            guard->init_failed = 1;
-            return 1;
-        }
+    if ((PyObject *)func == guard->func) {
+        /* Replacing the code object of a function already removes its
+         * specialized code, no need to add a guard */
+        PyErr_SetString(PyExc_ValueError,
+                        "useless GuardFunc, a function already watch itself");
+        return -1;
     }
-
-    guard->init_failed = 0;
     return 0;
 }
 
 static int
-guard_builtins_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+check_func_guard(GuardFuncObject *guard)
 {
-    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
-    GuardDictObject *guard_globals = (GuardDictObject *)guard->guard_globals;
-    PyThreadState* tstate;
-    PyFrameObject *frame;
-    int res;
+    PyFunctionObject *func;
 
-    if (unlikely(guard->init_failed == -1)) {
-        guard_builtins_init_guard(self, NULL);
-        assert(guard->init_failed != -1);
-    }
+    assert(Py_TYPE(guard->func) == &PyFunction_Type);
+    func = (PyFunctionObject *)guard->func;
 
-    if (unlikely(guard->init_failed))
+    if (((PyFunctionObject *)func)->func_code != guard->code)
         return 2;
 
-    tstate = PyThreadState_GET();
-    assert(tstate != NULL);
+    return 0;
+}
 
-    frame = tstate->frame;
-    if (frame == NULL) {
-        /* Python is probably being finalized */
-        return 2;
-    }
+static int
+guard_func_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_func_guard((GuardFuncObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_func_stats, res);
+}
 
-    /* If the frame globals dictionary is different than the frame globals
-     * dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_globals != guard_globals->dict)) {
-        return 2;
-    }
+static void
+guard_func_dealloc(GuardFuncObject *self)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
 
-    /* If the builtin dictionary of the current frame is different than the
-     * builtin dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_builtins != guard->base.dict)) {
-        return 2;
-    }
+    Py_XDECREF(guard->func);
+    Py_XDECREF(guard->code);
 
-    res = guard_dict_check(guard->guard_globals, stack, nargs, kwnames);
-    if (unlikely(res)) {
-        return res;
-    }
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_func_traverse(GuardFuncObject *self, visitproc visit, void *arg)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
 
-    return guard_dict_check(self, stack, nargs, kwnames);
+    Py_VISIT(guard->func);
+    Py_VISIT(guard->code);
+    return 0;
 }
 
 static PyObject *
-guard_builtins_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_func_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardBuiltinsObject *self;
+    GuardFuncObject *self;
 
-    op = GuardDict_Type.tp_new(type, args, kwds);
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardBuiltinsObject *)op;
-    self->base.base.init = guard_builtins_init_guard;
-    self->base.base.check = guard_builtins_check;
-    self->init_failed = -1;
-
-    /* object allocator must initialize the structure to zeros */
-    assert(self->guard_globals == NULL);
+    self = (GuardFuncObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_func_init_guard;
+    self->base.check = guard_func_check;
+    self->func = NULL;
+    self->code = NULL;
 
     return op;
 }
 
 static int
-guard_builtins_init(PyObject *op, PyObject *args, PyObject *kwargs)
+guard_func_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    PyObject *builtins, *keys;
-    PyObject *guard_globals;
+    GuardFuncObject *self = (GuardFuncObject *)op;
+    static char *keywords[] = {"func", NULL};
+    PyObject *func;
+    PyObject *code;
 
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardFunc", keywords,
+                                     &func))
         return -1;
-    }
-    keys = args;
 
-    builtins = PyEval_GetBuiltins();
-    if (builtins == NULL) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "unable to get builtins");
+    if (!PyFunction_Check(func)) {
+        PyErr_Format(PyExc_TypeError,
+                     "func must be a function, not %s",
+                     Py_TYPE(func)->tp_name);
         return -1;
     }
 
-    if (!PyDict_Check(builtins)) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "frame builtins is not a dict");
-        return -1;
-    }
+    code = ((PyFunctionObject*)func)->func_code;
 
-    guard_globals = PyObject_CallObject((PyObject *)&GuardGlobals_Type, keys);
-    if (guard_globals == NULL)
-        return -1;
+    Py_INCREF(func);
+    self->func = func;
+    Py_INCREF(code);
+    self->code = code;
+    return 0;
+}
 
-    if (guard_dict_init_keys(op, builtins, 0, keys) < 0) {
-        Py_DECREF(guard_globals);
+static PyMemberDef guard_func_members[] = {
+    {"func",   T_OBJECT,   offsetof(GuardFuncObject, func),
+     RESTRICTED|READONLY},
+    {"code",   T_OBJECT,   offsetof(GuardFuncObject, code),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef guard_func_getsetlist[] = {
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+static PyTypeObject GuardFunc_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardFunc",
+    sizeof(GuardFuncObject),
+    0,
+    (destructor)guard_func_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)guard_func_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_func_members,                         /* tp_members */
+    guard_func_getsetlist,                      /* tp_getset */
+    &PyFuncGuard_Type,                      /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_func_init,                            /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_func_new,                             /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardCell */
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    PyObject *func;
+    /* name of the free variable of func */
+    PyObject *name;
+    /* index of the free variable in func.__code__.co_freevars */
+    Py_ssize_t index;
+    PyObject *cell;
+    /* content of the cell when the guard was created, NULL if the cell
+       was empty */
+    PyObject *value;
+} GuardCellObject;
+
+static int
+guard_cell_init_guard(PyObject *self, PyObject *func)
+{
+    GuardCellObject *guard = (GuardCellObject *)self;
+    PyCodeObject *code;
+    PyObject *closure;
+    int cmp;
+
+    if (func == guard->func)
+        return 0;
+
+    /* Another function (ex: created by the same factory) must read its free
+       variable from the same cell, otherwise the guard doesn't watch the
+       free variable of func: don't specialize */
+    if (!PyFunction_Check(func))
+        return 1;
+    code = (PyCodeObject *)((PyFunctionObject *)func)->func_code;
+    closure = ((PyFunctionObject *)func)->func_closure;
+    if (guard->index >= PyTuple_GET_SIZE(code->co_freevars))
+        return 1;
+    if (closure == NULL || !PyTuple_Check(closure)
+        || guard->index >= PyTuple_GET_SIZE(closure)
+        || PyTuple_GET_ITEM(closure, guard->index) != guard->cell)
+        return 1;
+
+    cmp = PyUnicode_Compare(PyTuple_GET_ITEM(code->co_freevars, guard->index),
+                            guard->name);
+    if (cmp == -1 && PyErr_Occurred())
         return -1;
-    }
+    return (cmp != 0);
+}
+
+static int
+check_cell_guard(GuardCellObject *guard)
+{
+    if (PyCell_GET(guard->cell) != guard->value)
+        return 2;
+    return 0;
+}
+
+static int
+guard_cell_check(PyObject *self, PyObject** stack, Py_ssize_t nargs,
+                 PyObject *kwnames)
+{
+    int res = check_cell_guard((GuardCellObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_cell_stats, res);
+}
+
+static void
+guard_cell_clear(GuardCellObject *guard)
+{
+    Py_CLEAR(guard->func);
+    Py_CLEAR(guard->name);
+    Py_CLEAR(guard->cell);
+    Py_CLEAR(guard->value);
+}
+
+static void
+guard_cell_dealloc(GuardCellObject *self)
+{
+    guard_cell_clear(self);
 
-    ((GuardBuiltinsObject *)op)->guard_globals = guard_globals;
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
 
+static int
+guard_cell_traverse(GuardCellObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->func);
+    Py_VISIT(self->name);
+    Py_VISIT(self->cell);
+    Py_VISIT(self->value);
     return 0;
 }
 
+static PyObject *
+guard_cell_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardCellObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardCellObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_cell_init_guard;
+    self->base.check = guard_cell_check;
+    self->func = NULL;
+    self->name = NULL;
+    self->index = 0;
+    self->cell = NULL;
+    self->value = NULL;
+
+    return op;
+}
+
 static int
-guard_builtins_traverse(GuardBuiltinsObject *self, visitproc visit, void *arg)
+guard_cell_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    int res = guard_dict_traverse((GuardDictObject *)self, visit, arg);
-    if (res)
-        return res;
-    Py_VISIT(self->guard_globals);
+    GuardCellObject *self = (GuardCellObject *)op;
+    static char *keywords[] = {"func", "freevar_name", NULL};
+    PyObject *func, *name;
+    PyCodeObject *code;
+    PyObject *closure, *cell, *value;
+    Py_ssize_t i, nfree;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OU:GuardCell", keywords,
+                                     &func, &name))
+        return -1;
+
+    if (!PyFunction_Check(func)) {
+        PyErr_Format(PyExc_TypeError,
+                     "func must be a function, not %s",
+                     Py_TYPE(func)->tp_name);
+        return -1;
+    }
+
+    code = (PyCodeObject *)((PyFunctionObject *)func)->func_code;
+    closure = ((PyFunctionObject *)func)->func_closure;
+    nfree = PyTuple_GET_SIZE(code->co_freevars);
+
+    for (i=0; i < nfree; i++) {
+        int cmp;
+
+        cmp = PyUnicode_Compare(PyTuple_GET_ITEM(code->co_freevars, i),
+                                name);
+        if (cmp == -1 && PyErr_Occurred())
+            return -1;
+        if (cmp == 0)
+            break;
+    }
+    if (i == nfree) {
+        PyErr_Format(PyExc_ValueError,
+                     "function %R has no free variable %R",
+                     ((PyFunctionObject *)func)->func_qualname, name);
+        return -1;
+    }
+
+    if (closure == NULL || !PyTuple_Check(closure)
+        || i >= PyTuple_GET_SIZE(closure)
+        || !PyCell_Check(PyTuple_GET_ITEM(closure, i))) {
+        PyErr_SetString(PyExc_ValueError,
+                        "function closure doesn't match its free variables");
+        return -1;
+    }
+    cell = PyTuple_GET_ITEM(closure, i);
+    value = PyCell_GET(cell);
+
+    guard_cell_clear(self);
+
+    Py_INCREF(func);
+    self->func = func;
+    Py_INCREF(name);
+    self->name = name;
+    self->index = i;
+    Py_INCREF(cell);
+    self->cell = cell;
+    Py_XINCREF(value);
+    self->value = value;
     return 0;
 }
 
-static PyMemberDef guard_builtins_members[] = {
-    {"guard_globals",   T_OBJECT,   offsetof(GuardBuiltinsObject, guard_globals),
+static PyMemberDef guard_cell_members[] = {
+    {"func", T_OBJECT, offsetof(GuardCellObject, func),
+     RESTRICTED|READONLY},
+    {"freevar_name", T_OBJECT, offsetof(GuardCellObject, name),
+     RESTRICTED|READONLY},
+    {"cell", T_OBJECT, offsetof(GuardCellObject, cell),
      RESTRICTED|READONLY},
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject GuardBuiltins_Type = {
+static PyGetSetDef guard_cell_getsetlist[] = {
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_cell_doc,
+"GuardCell(func, freevar_name)\n"
+"\n"
+"Guard on the content of the closure cell of the free variable\n"
+"freevar_name of func: the cell must contain the same object.");
+
+static PyTypeObject GuardCell_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardBuiltins",
-    sizeof(GuardBuiltinsObject),
+    "fat.GuardCell",
+    sizeof(GuardCellObject),
     0,
-    (destructor)guard_builtins_dealloc,         /* tp_dealloc */
+    (destructor)guard_cell_dealloc,             /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -1008,148 +1979,3514 @@ static PyTypeObject GuardBuiltins_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_builtins_traverse,      /* tp_traverse */
+    guard_cell_doc,                             /* tp_doc */
+    (traverseproc)guard_cell_traverse,          /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    guard_builtins_members,                     /* tp_members */
-    0,                                          /* tp_getset */
-    &GuardDict_Type,                            /* tp_base */
+    guard_cell_members,                         /* tp_members */
+    guard_cell_getsetlist,                      /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_builtins_init,                        /* tp_init */
+    guard_cell_init,                            /* tp_init */
     0,                                          /* tp_alloc */
-    guard_builtins_new,                         /* tp_new */
+    guard_cell_new,                             /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* Functions */
+/* GuardType */
+
+typedef struct {
+    /* interned attribute name */
+    PyObject *key;
+    /* value of type.key found in the MRO, NULL if the attribute
+       doesn't exist */
+    PyObject *value;
+} GuardTypePair;
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    PyTypeObject *type;
+    /* tp_version_tag of type when attributes were last checked */
+    unsigned int version_tag;
+    Py_ssize_t npair;
+    GuardTypePair *pairs;
+} GuardTypeObject;
+
+static int
+check_type_guard(GuardTypeObject *guard)
+{
+    PyTypeObject *type = guard->type;
+    Py_ssize_t i;
+
+    /* PyType_Modified() clears the flag of the type and its subclasses */
+    if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)
+        && type->tp_version_tag == guard->version_tag)
+        return 0;
+
+    /* the type or one of its bases was modified: check attributes */
+    for (i=0; i < guard->npair; i++) {
+        GuardTypePair *pair = &guard->pairs[i];
+
+        if (_PyType_Lookup(type, pair->key) != pair->value)
+            return 2;
+    }
+
+    /* attributes are unchanged: the lookups assigned a new version tag */
+    if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG))
+        guard->version_tag = type->tp_version_tag;
+    return 0;
+}
+
+static int
+guard_type_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_type_guard((GuardTypeObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_type_stats, res);
+}
+
+static void
+guard_type_clear(GuardTypeObject *guard)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < guard->npair; i++) {
+        Py_CLEAR(guard->pairs[i].key);
+        Py_CLEAR(guard->pairs[i].value);
+    }
+    PyMem_Free(guard->pairs);
+    guard->npair = 0;
+    guard->pairs = NULL;
+    Py_CLEAR(guard->type);
+}
+
+static void
+guard_type_dealloc(GuardTypeObject *self)
+{
+    guard_type_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_type_traverse(GuardTypeObject *guard, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(guard->type);
+    for (i=0; i < guard->npair; i++) {
+        Py_VISIT(guard->pairs[i].key);
+        Py_VISIT(guard->pairs[i].value);
+    }
+    return 0;
+}
+
+static PyObject *
+guard_type_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardTypeObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardTypeObject *)op;
+    guard_state_init(op);
+    self->base.check = guard_type_check;
+    self->type = NULL;
+    self->version_tag = 0;
+    self->npair = 0;
+    self->pairs = NULL;
+
+    return op;
+}
+
+static int
+guard_type_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardTypeObject *self = (GuardTypeObject *)op;
+    PyObject *type;
+    GuardTypePair *pairs = NULL;
+    Py_ssize_t nkeys, i, npair = 0;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "GuardType() takes no keyword arguments");
+        return -1;
+    }
+
+    nkeys = PyTuple_GET_SIZE(args) - 1;
+    if (nkeys <= 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "GuardType() requires a type and at least "
+                        "one attribute");
+        return -1;
+    }
+
+    type = PyTuple_GET_ITEM(args, 0);
+    if (!PyType_Check(type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "type must be a type, not %s",
+                     Py_TYPE(type)->tp_name);
+        return -1;
+    }
+
+    if (nkeys > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(pairs[0])) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    pairs = PyMem_Malloc(nkeys * sizeof(pairs[0]));
+    if (pairs == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i=0; i < nkeys; i++) {
+        PyObject *key, *value;
+
+        key = PyTuple_GET_ITEM(args, i + 1);
+        if (!PyUnicode_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "attribute name must be str, not %s",
+                         Py_TYPE(key)->tp_name);
+            goto error;
+        }
+
+        Py_INCREF(key);
+        PyUnicode_InternInPlace(&key);
+
+        /* lookup in the MRO, as type.key */
+        value = _PyType_Lookup((PyTypeObject *)type, key);
+        Py_XINCREF(value);
+
+        pairs[npair].key = key;
+        pairs[npair].value = value;
+        npair++;
+    }
+
+    guard_type_clear(self);
+
+    Py_INCREF(type);
+    self->type = (PyTypeObject *)type;
+    /* tag assigned by the lookups, or 0 if the type has no valid tag:
+       attributes are then checked at each call */
+    if (PyType_HasFeature((PyTypeObject *)type, Py_TPFLAGS_VALID_VERSION_TAG))
+        self->version_tag = ((PyTypeObject *)type)->tp_version_tag;
+    else
+        self->version_tag = 0;
+    self->npair = npair;
+    self->pairs = pairs;
+    return 0;
+
+error:
+    for (i=0; i < npair; i++) {
+        Py_DECREF(pairs[i].key);
+        Py_XDECREF(pairs[i].value);
+    }
+    PyMem_Free(pairs);
+    return -1;
+}
+
+static PyObject*
+guard_type_get_keys(GuardTypeObject *self)
+{
+    PyObject *tuple;
+    Py_ssize_t i;
+
+    tuple = PyTuple_New(self->npair);
+    if (tuple == NULL)
+        return NULL;
+
+    for (i=0; i < self->npair; i++) {
+        PyObject *key = self->pairs[i].key;
+
+        Py_INCREF(key);
+        PyTuple_SET_ITEM(tuple, i, key);
+    }
+    return tuple;
+}
+
+static PyGetSetDef guard_type_getsetlist[] = {
+    {"keys", (getter)guard_type_get_keys},
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_type_members[] = {
+    {"type",   T_OBJECT,   offsetof(GuardTypeObject, type),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_type_doc,
+"GuardType(type, *attrs)\n"
+"\n"
+"Guard on type.attr for all attrs, attributes are looked up in the MRO.\n"
+"Only the version tag of type is checked, until type or one of its base\n"
+"classes is modified.");
+
+static PyTypeObject GuardType_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardType",
+    sizeof(GuardTypeObject),
+    0,
+    (destructor)guard_type_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_type_doc,                             /* tp_doc */
+    (traverseproc)guard_type_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_type_members,                         /* tp_members */
+    guard_type_getsetlist,                      /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_type_init,                            /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_type_new,                             /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* Dict entries */
+
+/* Copy of private structures of Objects/dict-common.h of CPython 3.6,
+   used to read the value of a dict entry from its index. The layout is
+   checked at runtime by fat_init_dict_entries(). */
+typedef struct {
+    Py_hash_t me_hash;
+    PyObject *me_key;
+    PyObject *me_value;
+} DictKeyEntry;
+
+struct _dictkeysobject {
+    Py_ssize_t dk_refcnt;
+    Py_ssize_t dk_size;
+    void *dk_lookup;
+    Py_ssize_t dk_usable;
+    Py_ssize_t dk_nentries;
+    union {
+        int8_t as_1[8];
+        int16_t as_2[4];
+        int32_t as_4[2];
+#if SIZEOF_VOID_P > 4
+        int64_t as_8[1];
+#endif
+    } dk_indices;
+};
+
+#if SIZEOF_VOID_P > 4
+#  define DK_IXSIZE(dk) \
+    ((dk)->dk_size <= 0xff ? \
+        1 : (dk)->dk_size <= 0xffff ? \
+            2 : (dk)->dk_size <= 0xffffffff ? \
+                4 : sizeof(int64_t))
+#else
+#  define DK_IXSIZE(dk) \
+    ((dk)->dk_size <= 0xff ? \
+        1 : (dk)->dk_size <= 0xffff ? \
+            2 : sizeof(int32_t))
+#endif
+#define DK_ENTRIES(dk) \
+    ((DictKeyEntry*)(&(dk)->dk_indices.as_1[(dk)->dk_size * DK_IXSIZE(dk)]))
+
+/* Set to 1 if the layout of dict entries is the expected one */
+static int dict_entries_ok = 0;
+
+/* Find the index of the dict entry of key. Only compare key pointers.
+   Return -1 if not found. */
+static Py_ssize_t
+dict_find_entry(PyDictObject *mp, PyObject *key)
+{
+    PyDictKeysObject *keys = mp->ma_keys;
+    DictKeyEntry *entries;
+    Py_ssize_t i;
+
+    if (!dict_entries_ok)
+        return -1;
+
+    entries = DK_ENTRIES(keys);
+    for (i=0; i < keys->dk_nentries; i++) {
+        if (entries[i].me_key == key)
+            return i;
+    }
+    return -1;
+}
+
+/* Get the value of the dict entry index if its key is key.
+   Return a borrowed reference, or NULL if the entry has a different key,
+   has been deleted, or if the index is outdated (dict resized). */
+static PyObject*
+dict_entry_value(PyDictObject *mp, PyObject *key, Py_ssize_t index)
+{
+    PyDictKeysObject *keys = mp->ma_keys;
+    DictKeyEntry *entry;
+
+    assert(dict_entries_ok && index >= 0);
+
+    if (unlikely(index >= keys->dk_nentries))
+        return NULL;
+
+    entry = &DK_ENTRIES(keys)[index];
+    if (unlikely(entry->me_key != key))
+        return NULL;
+
+    if (mp->ma_values != NULL) {
+        /* split table */
+        return mp->ma_values[index];
+    }
+    return entry->me_value;
+}
+
+static int
+fat_init_dict_entries(void)
+{
+    PyObject *dict, *key1 = NULL, *key2 = NULL;
+    PyDictKeysObject *keys;
+    int ok = 0;
+
+    dict = PyDict_New();
+    if (dict == NULL)
+        return -1;
+
+    key1 = PyUnicode_InternFromString("__fat_key1__");
+    if (key1 == NULL)
+        goto error;
+    key2 = PyUnicode_InternFromString("__fat_key2__");
+    if (key2 == NULL)
+        goto error;
+
+    if (PyDict_SetItem(dict, key1, Py_True) < 0)
+        goto error;
+    if (PyDict_SetItem(dict, key2, Py_False) < 0)
+        goto error;
+
+    /* sanity checks before reading entries */
+    keys = ((PyDictObject *)dict)->ma_keys;
+    if (((PyDictObject *)dict)->ma_values == NULL
+        && keys->dk_refcnt == 1
+        && keys->dk_size == 8
+        && keys->dk_nentries == 2)
+    {
+        dict_entries_ok = 1;
+        ok = (dict_find_entry((PyDictObject *)dict, key1) == 0
+              && dict_find_entry((PyDictObject *)dict, key2) == 1
+              && dict_entry_value((PyDictObject *)dict, key1, 0) == Py_True
+              && dict_entry_value((PyDictObject *)dict, key2, 1) == Py_False);
+    }
+    /* if the layout is different, always lookup keys */
+    dict_entries_ok = ok;
+
+    Py_DECREF(dict);
+    Py_DECREF(key1);
+    Py_DECREF(key2);
+    return 0;
+
+error:
+    Py_DECREF(dict);
+    Py_XDECREF(key1);
+    Py_XDECREF(key2);
+    return -1;
+}
+
+
+/* GuardInstanceShape */
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    Py_ssize_t arg_index;
+    /* interned parameter name, or NULL if unknown */
+    PyObject *arg_name;
+    PyTypeObject *type;
+    unsigned int version_tag;
+    /* shared keys of instance dicts, or NULL if instances have no dict.
+       Borrowed reference: a reference would prevent the type from
+       rebuilding its shared keys. The pointer is only compared, the
+       layout of the keys is checked against attrs. */
+    PyDictKeysObject *keys;
+    /* keys of the entries of keys (tuple of str) */
+    PyObject *attrs;
+} GuardInstanceShapeObject;
+
+/* Check that the first entries of keys have the keys attrs, so keys
+   were not freed and replaced with other keys at the same address.
+   Key strings of attrs are kept alive by the guard. */
+static int
+instance_shape_keys_match(PyDictKeysObject *keys, PyObject *attrs)
+{
+    Py_ssize_t nattr = PyTuple_GET_SIZE(attrs), i;
+    DictKeyEntry *entries;
+
+    if (keys->dk_nentries < nattr)
+        return 0;
+
+    entries = DK_ENTRIES(keys);
+    for (i=0; i < nattr; i++) {
+        if (entries[i].me_key != PyTuple_GET_ITEM(attrs, i))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+guard_instance_shape_init_guard(PyObject *self, PyObject *func)
+{
+    GuardInstanceShapeObject *guard = (GuardInstanceShapeObject *)self;
+
+    return bind_arg_name(func, guard->arg_index, &guard->arg_name);
+}
+
+static int
+check_instance_shape_guard(GuardInstanceShapeObject *guard,
+                           PyObject **stack, Py_ssize_t nargs,
+                           PyObject *kwnames)
+{
+    PyObject *obj;
+    PyTypeObject *type;
+    PyObject **dictptr;
+
+    obj = get_call_arg(stack, nargs, kwnames,
+                       guard->arg_index, guard->arg_name);
+    if (obj == NULL)
+        return 1;
+
+    type = Py_TYPE(obj);
+    if (type != guard->type)
+        return 1;
+
+    /* PyType_Modified() clears the flag, a new tag is assigned later */
+    if (unlikely(!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)
+                 || type->tp_version_tag != guard->version_tag))
+        return 2;
+
+    if (guard->keys == NULL)
+        return 0;
+
+    dictptr = _PyObject_GetDictPtr(obj);
+    if (dictptr != NULL && *dictptr != NULL
+        && ((PyDictObject *)*dictptr)->ma_keys == guard->keys) {
+        if (instance_shape_keys_match(guard->keys, guard->attrs))
+            return 0;
+        /* new keys allocated at the address of the old keys */
+        return 2;
+    }
+
+    /* the type stopped sharing keys or replaced them:
+       new instances will never match */
+    if (((PyHeapTypeObject *)type)->ht_cached_keys != guard->keys)
+        return 2;
+    return 1;
+}
+
+static int
+guard_instance_shape_check(PyObject *self, PyObject **stack,
+                           Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_instance_shape_guard((GuardInstanceShapeObject *)self,
+                                         stack, nargs, kwnames);
+    return GUARD_CHECK_RESULT(self, guard_instance_shape_stats, res);
+}
+
+static void
+guard_instance_shape_dealloc(GuardInstanceShapeObject *self)
+{
+    Py_CLEAR(self->arg_name);
+    Py_CLEAR(self->attrs);
+    Py_CLEAR(self->type);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_instance_shape_traverse(GuardInstanceShapeObject *self,
+                              visitproc visit, void *arg)
+{
+    Py_VISIT(self->arg_name);
+    Py_VISIT(self->attrs);
+    Py_VISIT(self->type);
+    return 0;
+}
+
+static PyObject *
+guard_instance_shape_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardInstanceShapeObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardInstanceShapeObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_instance_shape_init_guard;
+    self->base.check = guard_instance_shape_check;
+    self->arg_index = 0;
+    self->arg_name = NULL;
+    self->type = NULL;
+    self->version_tag = 0;
+    self->keys = NULL;
+    self->attrs = NULL;
+
+    return op;
+}
+
+static int
+guard_instance_shape_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardInstanceShapeObject *self = (GuardInstanceShapeObject *)op;
+    static char *keywords[] = {"type", "arg_index", NULL};
+    _Py_IDENTIFIER(__class__);
+    PyTypeObject *type;
+    Py_ssize_t arg_index = 0, i;
+    PyDictKeysObject *keys = NULL;
+    PyObject *attrs = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|n:GuardInstanceShape",
+                                     keywords,
+                                     &PyType_Type, &type, &arg_index))
+        return -1;
+
+    if (arg_index < 0) {
+        PyErr_SetString(PyExc_ValueError, "arg_index must be >= 0");
+        return -1;
+    }
+
+    /* a lookup in the method cache assigns a version tag to the type */
+    if (_PyType_LookupId(type, &PyId___class__) == NULL && PyErr_Occurred())
+        return -1;
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        PyErr_Format(PyExc_ValueError,
+                     "type %s has no valid version tag",
+                     type->tp_name);
+        return -1;
+    }
+
+    if (type->tp_dictoffset != 0) {
+        if (!dict_entries_ok) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "unsupported dict implementation");
+            return -1;
+        }
+        if (PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+            keys = ((PyHeapTypeObject *)type)->ht_cached_keys;
+        if (keys == NULL) {
+            PyErr_Format(PyExc_ValueError,
+                         "instances of %s don't share dict keys",
+                         type->tp_name);
+            return -1;
+        }
+
+        /* shared keys have no deleted entry */
+        attrs = PyTuple_New(keys->dk_nentries);
+        if (attrs == NULL)
+            return -1;
+        for (i=0; i < keys->dk_nentries; i++) {
+            PyObject *key = DK_ENTRIES(keys)[i].me_key;
+            Py_INCREF(key);
+            PyTuple_SET_ITEM(attrs, i, key);
+        }
+    }
+
+    self->arg_index = arg_index;
+    self->keys = keys;
+    Py_XSETREF(self->attrs, attrs);
+    self->version_tag = type->tp_version_tag;
+    Py_INCREF(type);
+    Py_XSETREF(self->type, type);
+    return 0;
+}
+
+static PyMemberDef guard_instance_shape_members[] = {
+    {"type",   T_OBJECT,   offsetof(GuardInstanceShapeObject, type),
+     RESTRICTED|READONLY},
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardInstanceShapeObject, arg_index),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef guard_instance_shape_getsetlist[] = {
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_instance_shape_doc,
+"GuardInstanceShape(type, arg_index=0)\n"
+"\n"
+"Guard on the shape of an instance of type: the type of the argument\n"
+"arg_index must be type, type must not be modified, and the keys of the\n"
+"instance dict must be the keys shared by instances of type.");
+
+static PyTypeObject GuardInstanceShape_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardInstanceShape",
+    sizeof(GuardInstanceShapeObject),
+    0,
+    (destructor)guard_instance_shape_dealloc,   /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_instance_shape_doc,                   /* tp_doc */
+    (traverseproc)guard_instance_shape_traverse, /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_instance_shape_members,               /* tp_members */
+    guard_instance_shape_getsetlist,            /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_instance_shape_init,                  /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_instance_shape_new,                   /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardDict */
+
+typedef struct {
+    PyObject *key;
+    Py_hash_t hash;
+    PyObject *value;
+    /* index of the dict entry of key, or -1 if unknown */
+    Py_ssize_t index;
+    /* index of the pair in the pairs of the dict watcher */
+    Py_ssize_t watcher_index;
+} GuardDictPair;
+
+/* All guards watching the same dict share a dict watcher. The watcher
+   checks each unique (key, value) pair once per dict version, instead of
+   once per guard. Keys, values and the dict are borrowed references:
+   guards using the watcher hold strong references to them. */
+
+typedef struct {
+    GuardDictPair pair;
+    /* number of guards using the pair, 0 means that the slot is free */
+    Py_ssize_t refcnt;
+    /* 1 if the value of the key was modified at the watcher version */
+    int modified;
+    /* free slot: index of the next free slot, or -1 */
+    Py_ssize_t next_free;
+} DictWatcherPair;
+
+typedef struct {
+    PyObject *dict;
+    /* number of guards using the watcher */
+    Py_ssize_t refcnt;
+    /* dict version when pairs were checked */
+    PY_UINT64_T version;
+    /* number of modified pairs at version */
+    Py_ssize_t nmodified;
+    Py_ssize_t npair;
+    Py_ssize_t allocated;
+    DictWatcherPair *pairs;
+    /* index of the first free slot of pairs, or -1 */
+    Py_ssize_t free;
+    /* key => index of the last pair added for the key (int). The pair
+       may have been released since, or may have another value. */
+    PyObject *key_index;
+} DictWatcher;
+
+/* Registry of dict watchers: dict address (int) => capsule(DictWatcher*) */
+static PyObject *dict_watchers = NULL;
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    PyObject *dict;
+    PY_UINT64_T dict_version;
+    DictWatcher *watcher;
+    Py_ssize_t npair;
+    /* inline pairs or an array allocated on the heap */
+    GuardDictPair *pairs;
+    /* number of pairs stored inline, after the object: the guard is
+       allocated with room for the keys passed to the constructor, a new
+       call to __init__() with more keys allocates pairs on the heap.
+       PyFuncGuardObject has no ob_size field, so Py_SIZE() cannot be
+       used. */
+    Py_ssize_t ninline;
+    /* GuardGlobals and GuardBuiltins: 1 if the init hook checked that the
+       guarded dicts are the globals and builtins of the specialized
+       function, so the check doesn't need to read the current frame */
+    int bound;
+    /* weak references, used by the guard cache */
+    PyObject *weakreflist;
+} GuardDictObject;
+
+static void
+guard_dict_pair_dealloc(GuardDictPair *pair)
+{
+    Py_CLEAR(pair->key);
+    Py_CLEAR(pair->value);
+}
+
+static int
+check_dict_pair_guard(PyObject *dict, GuardDictPair *pair)
+{
+    PyObject *current_value;
+
+    if (PyDict_CheckExact(dict)) {
+        if (pair->index >= 0) {
+            /* fastest-path: read the value of the dict entry, no lookup */
+            current_value = dict_entry_value((PyDictObject *)dict,
+                                             pair->key, pair->index);
+            if (current_value == pair->value)
+                return 0;
+            if (current_value != NULL)
+                return 2;
+            /* the entry moved (dict resized) or was deleted */
+        }
+
+        /* fast-path: direct lookup using the cached hash of the interned
+           key, the dict lookup compares key pointers first. No need to
+           handle KeyError nor reference counting. */
+        current_value = _PyDict_GetItem_KnownHash(dict, pair->key,
+                                                  pair->hash);
+        if (current_value == pair->value) {
+            if (pair->index >= 0) {
+                /* update the outdated entry index */
+                pair->index = dict_find_entry((PyDictObject *)dict,
+                                              pair->key);
+            }
+            return 0;
+        }
+
+        if (current_value == NULL && PyErr_Occurred()) {
+            /* comparison of a str subclass key failed */
+            return -1;
+        }
+        return 2;
+    }
+
+    /* dict subclass: use the mapping protocol to call __missing__()
+       or overriden __getitem__() */
+    current_value = PyObject_GetItem(dict, pair->key);
+    if (current_value == NULL && PyErr_Occurred()) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+            /* lookup faileds */
+            return -1;
+        }
+        /* key doesn't exist */
+        PyErr_Clear();
+    }
+
+    /* we only care of the value pointer, not its content,
+       so it is safe to use the pointer after Py_DECREF */
+    Py_XDECREF(current_value);
+
+    if (current_value == pair->value) {
+        /* another key was modified, but the watched key is unchanged */
+        return 0;
+    }
+
+    /* the key was modified (removed or new value) */
+    return 2;
+}
+
+static PyObject*
+dict_watcher_registry_key(PyObject *dict)
+{
+    return PyLong_FromVoidPtr(dict);
+}
+
+/* Get the watcher of dict, create it if needed.
+   Return a new reference to the watcher. */
+static DictWatcher*
+dict_watcher_get(PyObject *dict)
+{
+    PyObject *key, *capsule;
+    DictWatcher *watcher;
+    int res;
+
+    if (dict_watchers == NULL) {
+        dict_watchers = PyDict_New();
+        if (dict_watchers == NULL)
+            return NULL;
+    }
+
+    key = dict_watcher_registry_key(dict);
+    if (key == NULL)
+        return NULL;
+
+    capsule = PyDict_GetItem(dict_watchers, key);
+    if (capsule != NULL) {
+        Py_DECREF(key);
+        watcher = PyCapsule_GetPointer(capsule, NULL);
+        assert(watcher != NULL && watcher->dict == dict);
+        watcher->refcnt++;
+        return watcher;
+    }
+
+    watcher = PyMem_Malloc(sizeof(DictWatcher));
+    if (watcher == NULL) {
+        Py_DECREF(key);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    watcher->dict = dict;
+    watcher->refcnt = 1;
+    watcher->version = ((PyDictObject *)dict)->ma_version_tag;
+    watcher->nmodified = 0;
+    watcher->npair = 0;
+    watcher->allocated = 0;
+    watcher->pairs = NULL;
+    watcher->free = -1;
+    watcher->key_index = PyDict_New();
+    if (watcher->key_index == NULL) {
+        Py_DECREF(key);
+        PyMem_Free(watcher);
+        return NULL;
+    }
+
+    capsule = PyCapsule_New(watcher, NULL, NULL);
+    if (capsule == NULL) {
+        Py_DECREF(key);
+        Py_DECREF(watcher->key_index);
+        PyMem_Free(watcher);
+        return NULL;
+    }
+    res = PyDict_SetItem(dict_watchers, key, capsule);
+    Py_DECREF(key);
+    Py_DECREF(capsule);
+    if (res < 0) {
+        Py_DECREF(watcher->key_index);
+        PyMem_Free(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+static void
+dict_watcher_release(DictWatcher *watcher)
+{
+    PyObject *key;
+    PyObject *exc_type, *exc_value, *exc_tb;
+
+    assert(watcher->refcnt >= 1);
+    watcher->refcnt--;
+    if (watcher->refcnt != 0)
+        return;
+
+    /* may be called by a deallocator: don't clear the current exception */
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    key = dict_watcher_registry_key(watcher->dict);
+    if (key == NULL || PyDict_DelItem(dict_watchers, key) < 0)
+        PyErr_WriteUnraisable(NULL);
+    Py_XDECREF(key);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+
+    Py_DECREF(watcher->key_index);
+    PyMem_Free(watcher->pairs);
+    PyMem_Free(watcher);
+}
+
+/* Add a pair to the watcher, or share an existing pair with the same key
+   and the same value. Return the index of the pair, or -1 on error. */
+static Py_ssize_t
+dict_watcher_add_pair(DictWatcher *watcher, GuardDictPair *pair)
+{
+    DictWatcherPair *wpair;
+    PyObject *index_obj;
+    Py_ssize_t free_index;
+
+    /* keys are interned strings with a cached hash */
+    index_obj = _PyDict_GetItem_KnownHash(watcher->key_index,
+                                          pair->key, pair->hash);
+    if (index_obj != NULL) {
+        Py_ssize_t index = PyLong_AsSsize_t(index_obj);
+
+        assert(0 <= index && index < watcher->npair);
+        wpair = &watcher->pairs[index];
+        if (wpair->refcnt != 0
+            && wpair->pair.key == pair->key
+            && wpair->pair.value == pair->value) {
+            wpair->refcnt++;
+            return index;
+        }
+    }
+    else if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (watcher->free >= 0) {
+        free_index = watcher->free;
+    }
+    else {
+        if (watcher->npair == watcher->allocated) {
+            DictWatcherPair *pairs;
+            Py_ssize_t allocated = watcher->allocated * 2 + 4;
+
+            if (allocated > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(DictWatcherPair)) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            pairs = PyMem_Realloc(watcher->pairs,
+                                  allocated * sizeof(DictWatcherPair));
+            if (pairs == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            watcher->pairs = pairs;
+            watcher->allocated = allocated;
+        }
+        free_index = watcher->npair;
+    }
+
+    index_obj = PyLong_FromSsize_t(free_index);
+    if (index_obj == NULL)
+        return -1;
+    if (_PyDict_SetItem_KnownHash(watcher->key_index, pair->key, index_obj,
+                                  pair->hash) < 0) {
+        Py_DECREF(index_obj);
+        return -1;
+    }
+    Py_DECREF(index_obj);
+
+    if (free_index == watcher->free)
+        watcher->free = watcher->pairs[free_index].next_free;
+    else
+        watcher->npair++;
+
+    /* the value was just read from the dict, so it is unchanged */
+    wpair = &watcher->pairs[free_index];
+    wpair->pair = *pair;
+    wpair->refcnt = 1;
+    wpair->modified = 0;
+    wpair->next_free = -1;
+    return free_index;
+}
+
+static void
+dict_watcher_release_pair(DictWatcher *watcher, Py_ssize_t index)
+{
+    DictWatcherPair *wpair = &watcher->pairs[index];
+
+    assert(wpair->refcnt >= 1);
+    wpair->refcnt--;
+    if (wpair->refcnt != 0)
+        return;
+
+    if (wpair->modified)
+        watcher->nmodified--;
+    wpair->modified = 0;
+    wpair->pair.key = NULL;
+    wpair->pair.value = NULL;
+    /* the key_index entry is kept: it is checked by dict_watcher_add_pair()
+       and replaced when the slot is reused */
+    wpair->next_free = watcher->free;
+    watcher->free = index;
+}
+
+/* Check all pairs of the watcher for the dict version.
+
+   The check can run Python code (__getitem__() of a dict subclass, __eq__()
+   of a key, __del__() of a value) which can add pairs (and so reallocate
+   the pairs array), release pairs or release the watcher: the caller must
+   hold a reference to the watcher, and the pair is copied during its
+   check. */
+static int
+dict_watcher_check(DictWatcher *watcher, PY_UINT64_T dict_version)
+{
+    Py_ssize_t i, nmodified = 0;
+
+    assert(watcher->refcnt >= 2);
+
+    for (i=0; i < watcher->npair; i++) {
+        DictWatcherPair *wpair = &watcher->pairs[i];
+        GuardDictPair pair;
+        int res;
+
+        if (wpair->refcnt == 0)
+            continue;
+
+        pair = wpair->pair;
+        Py_INCREF(pair.key);
+        Py_XINCREF(pair.value);
+        res = check_dict_pair_guard(watcher->dict, &pair);
+
+        /* the pair may have been released or reused during the check */
+        wpair = &watcher->pairs[i];
+        if (res >= 0 && wpair->refcnt != 0
+            && wpair->pair.key == pair.key
+            && wpair->pair.value == pair.value) {
+            wpair->pair.index = pair.index;
+            wpair->modified = (res != 0);
+        }
+        Py_DECREF(pair.key);
+        Py_XDECREF(pair.value);
+        if (res < 0)
+            return -1;
+    }
+
+    for (i=0; i < watcher->npair; i++) {
+        if (watcher->pairs[i].refcnt != 0)
+            nmodified += watcher->pairs[i].modified;
+    }
+    watcher->version = dict_version;
+    watcher->nmodified = nmodified;
+    return 0;
+}
+
+/* Release pairs created by dict_pairs_create() */
+static void
+dict_pairs_clear(DictWatcher *watcher, GuardDictPair *pairs, Py_ssize_t npair,
+                 GuardDictPair *small)
+{
+    Py_ssize_t i;
+
+    if (watcher != NULL) {
+        for (i=0; i < npair; i++)
+            dict_watcher_release_pair(watcher, pairs[i].watcher_index);
+        dict_watcher_release(watcher);
+    }
+
+    for (i=0; i < npair; i++)
+        guard_dict_pair_dealloc(&pairs[i]);
+    if (pairs != small)
+        PyMem_Free(pairs);
+}
+
+/* Pairs stored inline after the object: items of dict guard types are
+   pairs (tp_itemsize), the size of dict guard types is a multiple of the
+   pointer size */
+#define GUARD_DICT_INLINE_PAIRS(guard) \
+    ((GuardDictPair *)((char *)(guard) + Py_TYPE(guard)->tp_basicsize))
+
+static void
+guard_dict_clear(GuardDictObject *guard)
+{
+    dict_pairs_clear(guard->watcher, guard->pairs, guard->npair,
+                     GUARD_DICT_INLINE_PAIRS(guard));
+    guard->watcher = NULL;
+    guard->npair = 0;
+    guard->pairs = NULL;
+    Py_CLEAR(guard->dict);
+}
+
+static int
+check_dict_guard(GuardDictObject *guard)
+{
+    PY_UINT64_T dict_version;
+    PyObject *dict;
+    Py_ssize_t i;
+
+    dict = guard->dict;
+    assert(PyDict_Check(dict));
+
+    dict_version = (((PyDictObject*)(dict))->ma_version_tag);
+    if (unlikely(dict_version != guard->dict_version)) {
+        DictWatcher *watcher = guard->watcher;
+
+        assert(guard->npair >= 1);
+
+        /* pairs are only checked by the first guard of the dict
+           called after the dict was modified */
+        if (watcher->version != dict_version) {
+            int res, modified;
+
+            watcher->refcnt++;
+            res = dict_watcher_check(watcher, dict_version);
+            /* __init__() was called again during the check */
+            modified = (guard->watcher != watcher);
+            dict_watcher_release(watcher);
+            if (res < 0)
+                return -1;
+            if (modified)
+                return 1;
+        }
+
+        if (unlikely(watcher->nmodified != 0)) {
+            for (i=0; i < guard->npair; i++) {
+                Py_ssize_t index = guard->pairs[i].watcher_index;
+                if (watcher->pairs[index].modified) {
+                    /* the key was modified (removed or new value) */
+                    return 2;
+                }
+            }
+        }
+
+        guard->dict_version = dict_version;
+    }
+
+    return 0;
+}
+
+static int
+guard_dict_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_dict_guard((GuardDictObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_dict_stats, res);
+}
+
+static void
+guard_dict_dealloc(GuardDictObject *self)
+{
+    if (self->weakreflist != NULL)
+        PyObject_ClearWeakRefs((PyObject *)self);
+    guard_dict_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_dict_traverse(GuardDictObject *guard, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(guard->dict);
+    for (i=0; i < guard->npair; i++) {
+        Py_VISIT(guard->pairs[i].key);
+        Py_VISIT(guard->pairs[i].value);
+    }
+    return 0;
+}
+
+/* Number of inline pairs allocated by the next call to
+   guard_dict_tp_alloc() */
+static Py_ssize_t guard_dict_alloc_npair = 0;
+
+/* tp_alloc of dict guards. PyFuncGuard_Type.tp_new() calls
+   tp_alloc(type, 0): the number of inline pairs is passed by
+   guard_dict_alloc() in guard_dict_alloc_npair. PyType_GenericAlloc()
+   allocates nitems + 1 items. */
+static PyObject *
+guard_dict_tp_alloc(PyTypeObject *type, Py_ssize_t nitems)
+{
+    Py_ssize_t npair = guard_dict_alloc_npair;
+
+    guard_dict_alloc_npair = 0;
+    if (npair >= 1)
+        nitems += npair - 1;
+    return PyType_GenericAlloc(type, nitems);
+}
+
+/* Create a dict guard with room for narray arrays of ninline pairs after
+   the object */
+static PyObject *
+guard_dict_alloc(PyTypeObject *type, PyObject *args, PyObject *kwds,
+                 Py_ssize_t ninline, Py_ssize_t narray)
+{
+    PyObject *op;
+    GuardDictObject *self;
+
+    if (ninline > (PY_SSIZE_T_MAX - type->tp_basicsize) / narray
+                  / (Py_ssize_t)sizeof(GuardDictPair)) {
+        /* too many keys: allocate pairs on the heap */
+        ninline = 0;
+    }
+
+    guard_dict_alloc_npair = ninline * narray;
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    guard_dict_alloc_npair = 0;
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardDictObject *)op;
+    guard_state_init(op);
+    self->base.check = guard_dict_check;
+    self->dict = NULL;
+    self->dict_version = 0;
+    self->watcher = NULL;
+    self->npair = 0;
+    self->pairs = NULL;
+    self->ninline = ninline;
+    self->bound = 0;
+    self->weakreflist = NULL;
+    return op;
+}
+
+static PyObject *
+guard_dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    /* GuardDict(dict, *keys) */
+    Py_ssize_t nkeys = Py_MAX(PyTuple_GET_SIZE(args) - 1, 0);
+
+    return guard_dict_alloc(type, args, kwds, nkeys, 1);
+}
+
+/* Create the pairs of keys[first_key:] with their current value in dict,
+   and add them to the watcher of dict. Pairs are written into small (an
+   array of nsmall pairs, may be NULL) if they fit, or into an array
+   allocated on the heap. Return 0 on success, or -1 on error. */
+static int
+dict_pairs_create(PyObject *dict, Py_ssize_t first_key, PyObject *keys,
+                  GuardDictPair *small, Py_ssize_t nsmall,
+                  DictWatcher **pwatcher,
+                  GuardDictPair **ppairs, Py_ssize_t *pnpair)
+{
+    GuardDictPair *pairs = NULL;
+    Py_ssize_t nkeys, i, npair = 0, nwatched = 0;
+    DictWatcher *watcher = NULL;
+
+    /* FIXME: PyDict_CheckExact(dict)? */
+
+    if (!PyTuple_Check(keys)) {
+        PyErr_Format(PyExc_TypeError,
+                     "keys must be a tuple of str, not %s",
+                     Py_TYPE(keys)->tp_name);
+        goto error;
+    }
+
+    nkeys = PyTuple_GET_SIZE(keys);
+    if ((nkeys - first_key) <= 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keys must at least contain one key");
+        goto error;
+    }
+
+    if (nkeys - first_key <= nsmall) {
+        pairs = small;
+    }
+    else {
+        if (nkeys - first_key
+            > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(GuardDictPair)) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        pairs = PyMem_Malloc(sizeof(GuardDictPair) * (nkeys - first_key));
+        if (pairs == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    for (i=first_key; i < nkeys; i++) {
+        PyObject *key, *value;
+        Py_hash_t hash;
+
+        key = PyTuple_GET_ITEM(keys, i);
+
+        if (!PyUnicode_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "key must be str, not %s",
+                         Py_TYPE(key)->tp_name);
+            goto error;
+        }
+
+        /* Intern the key string */
+        Py_INCREF(key);
+        PyUnicode_InternInPlace(&key);
+
+        hash = PyObject_Hash(key);
+        if (hash == -1) {
+            Py_DECREF(key);
+            goto error;
+        }
+
+        value = PyObject_GetItem(dict, key);
+        if (value == NULL && PyErr_Occurred()) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                Py_DECREF(key);
+                goto error;
+            }
+            /* key doesn't exist */
+            PyErr_Clear();
+        }
+
+        pairs[npair].key = key;
+        pairs[npair].hash = hash;
+        pairs[npair].value = value;
+        if (value != NULL && PyDict_CheckExact(dict))
+            pairs[npair].index = dict_find_entry((PyDictObject *)dict, key);
+        else
+            pairs[npair].index = -1;
+        npair++;
+    }
+
+    watcher = dict_watcher_get(dict);
+    if (watcher == NULL)
+        goto error;
+    for (; nwatched < npair; nwatched++) {
+        Py_ssize_t index = dict_watcher_add_pair(watcher, &pairs[nwatched]);
+        if (index < 0)
+            goto error;
+        pairs[nwatched].watcher_index = index;
+    }
+
+    *pwatcher = watcher;
+    *ppairs = pairs;
+    *pnpair = npair;
+    return 0;
+
+error:
+    if (watcher != NULL) {
+        for (i=0; i < nwatched; i++)
+            dict_watcher_release_pair(watcher, pairs[i].watcher_index);
+        dict_watcher_release(watcher);
+    }
+    for (i=0; i < npair; i++)
+        guard_dict_pair_dealloc(&pairs[i]);
+    if (pairs != small)
+        PyMem_Free(pairs);
+    return -1;
+}
+
+static int
+guard_dict_init_keys(PyObject *op, PyObject *dict,
+                     Py_ssize_t first_key, PyObject *keys)
+{
+    GuardDictObject *self = (GuardDictObject *)op;
+    DictWatcher *watcher;
+    GuardDictPair *small, *pairs;
+    Py_ssize_t nsmall, npair;
+
+    /* old pairs are cleared after the new pairs are created:
+       inline pairs can only be used if they are unused */
+    small = GUARD_DICT_INLINE_PAIRS(self);
+    nsmall = (self->pairs != small) ? self->ninline : 0;
+
+    if (dict_pairs_create(dict, first_key, keys, small, nsmall,
+                          &watcher, &pairs, &npair) < 0)
+        return -1;
+
+    guard_dict_clear(self);
+
+    Py_INCREF(dict);
+    self->dict = dict;
+    self->dict_version = (((PyDictObject*)(dict))->ma_version_tag);
+    self->watcher = watcher;
+    self->npair = npair;
+    self->pairs = pairs;
+    self->bound = 0;
+    return 0;
+}
+
+static int
+guard_dict_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    PyObject *dict;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    assert(PyTuple_Check(args));
+    if (PyTuple_GET_SIZE(args) == 0) {
+        PyErr_SetString(PyExc_TypeError, "missing dict parameter");
+        return -1;
+    }
+    dict = PyTuple_GET_ITEM(args, 0);
+    if (!PyDict_Check(dict)) {
+        PyErr_Format(PyExc_TypeError,
+                     "dict parameter must be dict, got %s",
+                     Py_TYPE(dict)->tp_name);
+        return -1;
+    }
+
+    return guard_dict_init_keys(op, dict, 1, args);
+}
+
+static PyObject*
+guard_dict_get_keys(GuardDictObject *self)
+{
+    PyObject *tuple;
+    Py_ssize_t i;
+
+    tuple = PyTuple_New(self->npair);
+    if (tuple == NULL)
+        return NULL;
+
+    for (i=0; i < self->npair; i++) {
+        GuardDictPair *pair = &self->pairs[i];
+
+        Py_INCREF(pair->key);
+        PyTuple_SET_ITEM(tuple, i, pair->key);
+    }
+    return tuple;
+}
+
+static Py_ssize_t
+guard_dict_heap_size(GuardDictObject *self)
+{
+    if (self->pairs == GUARD_DICT_INLINE_PAIRS(self))
+        return 0;
+    return self->npair * sizeof(GuardDictPair);
+}
+
+static PyObject*
+guard_dict_sizeof(GuardDictObject *self)
+{
+    Py_ssize_t size = Py_TYPE(self)->tp_basicsize;
+    size += self->ninline * sizeof(GuardDictPair);
+    size += guard_dict_heap_size(self);
+    return PyLong_FromSsize_t(size);
+}
+
+static PyMethodDef guard_dict_methods[] = {
+    {"__sizeof__", (PyCFunction)guard_dict_sizeof, METH_NOARGS},
+    {NULL, NULL}   /* sentinel */
+};
+
+static PyGetSetDef guard_dict_getsetlist[] = {
+    {"keys", (getter)guard_dict_get_keys},
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_dict_members[] = {
+    {"dict",   T_OBJECT,   offsetof(GuardDictObject, dict),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject GuardDict_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardDict",
+    sizeof(GuardDictObject),
+    sizeof(GuardDictPair),
+    (destructor)guard_dict_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    offsetof(GuardDictObject, weakreflist),     /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    guard_dict_methods,                         /* tp_methods */
+    guard_dict_members,                         /* tp_members */
+    guard_dict_getsetlist,                      /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_dict_init,                            /* tp_init */
+    guard_dict_tp_alloc,                        /* tp_alloc */
+    guard_dict_new,                             /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardGlobals */
+
+/* Get the builtins dict of frames of functions using globals, as
+   PyFrame_New(). Return a borrowed reference, or NULL if globals has no
+   __builtins__ (no error is set). */
+static PyObject*
+globals_get_builtins(PyObject *globals)
+{
+    _Py_IDENTIFIER(__builtins__);
+    PyObject *builtins;
+
+    builtins = _PyDict_GetItemId(globals, &PyId___builtins__);
+    if (builtins != NULL && PyModule_Check(builtins))
+        builtins = PyModule_GetDict(builtins);
+    return builtins;
+}
+
+/* Check that the globals of func are globals: the frame check is not
+   needed anymore. Return 1 if they are different. */
+static int
+guard_globals_bind(PyObject *func, PyObject *globals, int *bound)
+{
+    if (((PyFunctionObject *)func)->func_globals != globals) {
+        /* the function uses different globals: don't specialize */
+        return 1;
+    }
+    *bound = 1;
+    return 0;
+}
+
+static int
+guard_globals_init_guard(PyObject *self, PyObject *func)
+{
+    GuardDictObject *guard = (GuardDictObject *)self;
+
+    return guard_globals_bind(func, guard->dict, &guard->bound);
+}
+
+static int
+check_globals_guard(GuardDictObject *guard)
+{
+    if (unlikely(!guard->bound)) {
+        /* guard not used to specialize a function: compare to the
+           globals of the current frame */
+        PyThreadState *tstate;
+        PyFrameObject *frame;
+
+        tstate = PyThreadState_GET();
+        assert(tstate != NULL);
+
+        frame = tstate->frame;
+        assert(frame != NULL);
+
+        /* If the frame globals dictionary is different than the frame
+         * globals dictionary used to create the guard, the guard check
+         * fails */
+        if (frame->f_globals != guard->dict)
+            return 2;
+    }
+
+    return check_dict_guard(guard);
+}
+
+static int
+guard_globals_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_globals_guard((GuardDictObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_globals_stats, res);
+}
+
+static PyObject *
+guard_globals_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardDictObject *self;
+
+    /* GuardGlobals(*keys) */
+    op = guard_dict_alloc(type, args, kwds, PyTuple_GET_SIZE(args), 1);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardDictObject *)op;
+    self->base.init = guard_globals_init_guard;
+    self->base.check = guard_globals_check;
+
+    return op;
+}
+
+static int
+guard_globals_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    PyObject *globals, *keys;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    keys = args;
+
+    globals = PyEval_GetGlobals();
+    if (globals == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return -1;
+    }
+
+    return guard_dict_init_keys(op, globals, 0, keys);
+}
+
+
+PyDoc_STRVAR(guard_globals_doc,
+"GuardGlobals(keys)\n"
+"\n"
+"Guard on globals()[key] for all keys.");
+
+static PyTypeObject GuardGlobals_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardGlobals",
+    sizeof(GuardDictObject),
+    sizeof(GuardDictPair),
+    0,                                          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_globals_doc,                          /* tp_doc */
+    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    offsetof(GuardDictObject, weakreflist),     /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    &GuardDict_Type,                            /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_globals_init,                        /* tp_init */
+    guard_dict_tp_alloc,                        /* tp_alloc */
+    guard_globals_new,                         /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardBuiltins */
+
+/* Guard on builtins and globals in a single guard: pairs of the builtins
+   dict are stored in base, pairs of the globals dict (same keys, which
+   must not exist in globals) are stored in globals_pairs. Inline globals
+   pairs follow the inline builtins pairs. */
+typedef struct {
+    GuardDictObject base;
+    int init_failed;
+    PyObject *globals;
+    PY_UINT64_T globals_version;
+    DictWatcher *globals_watcher;
+    /* globals_pairs[i] has the key of base.pairs[i] */
+    GuardDictPair *globals_pairs;
+} GuardBuiltinsObject;
+
+#define GUARD_BUILTINS_INLINE_GLOBALS_PAIRS(guard) \
+    (GUARD_DICT_INLINE_PAIRS(guard) + (guard)->base.ninline)
+
+static void
+guard_builtins_clear(GuardBuiltinsObject *guard)
+{
+    dict_pairs_clear(guard->globals_watcher, guard->globals_pairs,
+                     guard->base.npair,
+                     GUARD_BUILTINS_INLINE_GLOBALS_PAIRS(guard));
+    guard->globals_watcher = NULL;
+    guard->globals_pairs = NULL;
+    Py_CLEAR(guard->globals);
+    guard_dict_clear(&guard->base);
+}
+
+static void
+guard_builtins_dealloc(GuardBuiltinsObject *self)
+{
+    if (self->base.weakreflist != NULL)
+        PyObject_ClearWeakRefs((PyObject *)self);
+    guard_builtins_clear(self);
+    guard_dict_dealloc(&self->base);
+}
+
+static int
+guard_builtins_init_guard(PyObject *self, PyObject *func)
+{
+    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
+    Py_ssize_t i;
+    PyObject *init_value;
+
+    assert(init_builtins_snapshot != NULL);
+
+    for (i=0; i < guard->base.npair; i++) {
+        PyObject *name = guard->base.pairs[i].key;
+        PyObject *value = guard->base.pairs[i].value;
+
+        init_value = PyDict_GetItemWithError(init_builtins_snapshot, name);
+        if (init_value == NULL && PyErr_Occurred())
+            return -1;
+
+        if (value != init_value) {
+            /* builtin was modified since Python initialization:
+               don't specialize the function */
+            guard->init_failed = 1;
+            return 1;
+        }
+    }
+
+    for (i=0; i < guard->base.npair; i++) {
+        if (guard->globals_pairs[i].value != NULL) {
+            /* if name already exists in global, the guard must fail */
+            guard->init_failed = 1;
+            return 1;
+        }
+    }
+
+    guard->init_failed = 0;
+
+    if (func != NULL) {
+        if (globals_get_builtins(guard->globals) != guard->base.dict) {
+            /* frames of the function use different builtins */
+            return 1;
+        }
+        return guard_globals_bind(func, guard->globals, &guard->base.bound);
+    }
+    return 0;
+}
+
+/* Slow-path: globals or builtins were modified. Check the watchers of
+   modified dicts, and then walk keys once for both dicts. */
+static int
+check_builtins_pairs(GuardBuiltinsObject *guard,
+                     PY_UINT64_T globals_version,
+                     PY_UINT64_T builtins_version)
+{
+    DictWatcher *globals_watcher = guard->globals_watcher;
+    DictWatcher *builtins_watcher = guard->base.watcher;
+    int check_globals = 0, check_builtins = 0;
+    int res = 0, modified;
+    Py_ssize_t i;
+
+    globals_watcher->refcnt++;
+    builtins_watcher->refcnt++;
+
+    if (globals_version != guard->globals_version
+        && globals_watcher->version != globals_version)
+        res = dict_watcher_check(globals_watcher, globals_version);
+
+    if (res == 0
+        && builtins_version != guard->base.dict_version
+        && builtins_watcher->version != builtins_version)
+        res = dict_watcher_check(builtins_watcher, builtins_version);
+
+    /* __init__() was called again during the check */
+    modified = (guard->globals_watcher != globals_watcher
+                || guard->base.watcher != builtins_watcher);
+    dict_watcher_release(globals_watcher);
+    dict_watcher_release(builtins_watcher);
+    if (res < 0)
+        return -1;
+    if (modified)
+        return 1;
+
+    if (globals_version != guard->globals_version)
+        check_globals = (globals_watcher->nmodified != 0);
+    if (builtins_version != guard->base.dict_version)
+        check_builtins = (builtins_watcher->nmodified != 0);
+
+    if (unlikely(check_globals || check_builtins)) {
+        for (i=0; i < guard->base.npair; i++) {
+            Py_ssize_t index;
+
+            if (check_globals) {
+                index = guard->globals_pairs[i].watcher_index;
+                if (globals_watcher->pairs[index].modified)
+                    return 2;
+            }
+            if (check_builtins) {
+                index = guard->base.pairs[i].watcher_index;
+                if (builtins_watcher->pairs[index].modified)
+                    return 2;
+            }
+        }
+    }
+
+    guard->globals_version = globals_version;
+    guard->base.dict_version = builtins_version;
+    return 0;
+}
+
+static int
+check_builtins_guard(GuardBuiltinsObject *guard)
+{
+    PY_UINT64_T globals_version, builtins_version;
+
+    if (unlikely(guard->init_failed == -1)) {
+        if (guard_builtins_init_guard((PyObject *)guard, NULL) < 0)
+            return -1;
+        assert(guard->init_failed != -1);
+    }
+
+    if (unlikely(guard->init_failed))
+        return 2;
+
+    if (unlikely(!guard->base.bound)) {
+        /* guard not used to specialize a function: compare to the
+           globals and builtins of the current frame */
+        PyThreadState* tstate;
+        PyFrameObject *frame;
+
+        tstate = PyThreadState_GET();
+        assert(tstate != NULL);
+
+        frame = tstate->frame;
+        if (frame == NULL) {
+            /* Python is probably being finalized */
+            return 2;
+        }
+
+        /* If the frame globals dictionary is different than the frame
+         * globals dictionary used to create the guard, the guard check
+         * fails */
+        if (frame->f_globals != guard->globals)
+            return 2;
+
+        /* If the builtin dictionary of the current frame is different than
+         * the builtin dictionary used to create the guard, the guard check
+         * fails */
+        if (frame->f_builtins != guard->base.dict)
+            return 2;
+    }
+
+    globals_version = ((PyDictObject *)guard->globals)->ma_version_tag;
+    builtins_version = ((PyDictObject *)guard->base.dict)->ma_version_tag;
+    if (globals_version == guard->globals_version
+        && builtins_version == guard->base.dict_version)
+        return 0;
+
+    if (guard->base.bound && globals_version != guard->globals_version
+        && globals_get_builtins(guard->globals) != guard->base.dict) {
+        /* __builtins__ of globals was replaced */
+        return 2;
+    }
+
+    return check_builtins_pairs(guard, globals_version, builtins_version);
+}
+
+static int
+guard_builtins_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    int res = check_builtins_guard((GuardBuiltinsObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_builtins_stats, res);
+}
+
+static PyObject *
+guard_builtins_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardBuiltinsObject *self;
+
+    /* GuardBuiltins(*keys): builtins and globals pairs */
+    op = guard_dict_alloc(type, args, kwds, PyTuple_GET_SIZE(args), 2);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardBuiltinsObject *)op;
+    self->base.base.init = guard_builtins_init_guard;
+    self->base.base.check = guard_builtins_check;
+    self->init_failed = -1;
+    self->globals = NULL;
+    self->globals_version = 0;
+    self->globals_watcher = NULL;
+    self->globals_pairs = NULL;
+
+    return op;
+}
+
+static int
+guard_builtins_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardBuiltinsObject *self = (GuardBuiltinsObject *)op;
+    PyObject *builtins, *globals, *keys;
+    DictWatcher *globals_watcher;
+    GuardDictPair *small, *globals_pairs;
+    Py_ssize_t nsmall, npair;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    keys = args;
+
+    builtins = PyEval_GetBuiltins();
+    if (builtins == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get builtins");
+        return -1;
+    }
+
+    if (!PyDict_Check(builtins)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "frame builtins is not a dict");
+        return -1;
+    }
+
+    globals = PyEval_GetGlobals();
+    if (globals == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return -1;
+    }
+
+    /* old pairs are cleared after the new pairs are created */
+    small = GUARD_BUILTINS_INLINE_GLOBALS_PAIRS(self);
+    nsmall = (self->globals_pairs != small) ? self->base.ninline : 0;
+
+    if (dict_pairs_create(globals, 0, keys, small, nsmall,
+                          &globals_watcher, &globals_pairs, &npair) < 0)
+        return -1;
+
+    guard_builtins_clear(self);
+
+    if (guard_dict_init_keys(op, builtins, 0, keys) < 0) {
+        dict_pairs_clear(globals_watcher, globals_pairs, npair, small);
+        return -1;
+    }
+    assert(self->base.npair == npair);
+
+    Py_INCREF(globals);
+    self->globals = globals;
+    self->globals_version = ((PyDictObject *)globals)->ma_version_tag;
+    self->globals_watcher = globals_watcher;
+    self->globals_pairs = globals_pairs;
+    return 0;
+}
+
+static int
+guard_builtins_traverse(GuardBuiltinsObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+    int res;
+
+    res = guard_dict_traverse((GuardDictObject *)self, visit, arg);
+    if (res)
+        return res;
+    Py_VISIT(self->globals);
+    if (self->globals_pairs != NULL) {
+        for (i=0; i < self->base.npair; i++) {
+            Py_VISIT(self->globals_pairs[i].key);
+            Py_VISIT(self->globals_pairs[i].value);
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+guard_builtins_sizeof(GuardBuiltinsObject *self)
+{
+    Py_ssize_t size = Py_TYPE(self)->tp_basicsize;
+    size += self->base.ninline * 2 * sizeof(GuardDictPair);
+    size += guard_dict_heap_size(&self->base);
+    if (self->globals_pairs != NULL
+        && self->globals_pairs != GUARD_BUILTINS_INLINE_GLOBALS_PAIRS(self))
+        size += self->base.npair * sizeof(GuardDictPair);
+    return PyLong_FromSsize_t(size);
+}
+
+static PyMethodDef guard_builtins_methods[] = {
+    {"__sizeof__", (PyCFunction)guard_builtins_sizeof, METH_NOARGS},
+    {NULL, NULL}   /* sentinel */
+};
+
+static PyMemberDef guard_builtins_members[] = {
+    {"globals",   T_OBJECT,   offsetof(GuardBuiltinsObject, globals),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_builtins_doc,
+"GuardBuiltins(keys)\n"
+"\n"
+"Guard on builtins.__dict__[key] for all keys: the guard also fails if a\n"
+"key is defined in globals().\n"
+"\n"
+"Builtins are compared to their value when the fat module was imported:\n"
+"if a key was modified since, or if it is defined in globals(), the\n"
+"function is not specialized and the guard always fails. Modifications\n"
+"of other builtins don't matter.");
+
+static PyTypeObject GuardBuiltins_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardBuiltins",
+    sizeof(GuardBuiltinsObject),
+    sizeof(GuardDictPair),
+    (destructor)guard_builtins_dealloc,         /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_builtins_doc,                         /* tp_doc */
+    (traverseproc)guard_builtins_traverse,      /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    offsetof(GuardDictObject, weakreflist),     /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    guard_builtins_methods,                     /* tp_methods */
+    guard_builtins_members,                     /* tp_members */
+    0,                                          /* tp_getset */
+    &GuardDict_Type,                            /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_builtins_init,                        /* tp_init */
+    guard_dict_tp_alloc,                        /* tp_alloc */
+    guard_builtins_new,                         /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardModuleAttr */
+
+/* Link of the lookup path: key of dict, dict is globals for the first
+   link, or the dict of the module of the previous link */
+typedef struct {
+    PyObject *dict;
+    /* dict version when the pair was last checked */
+    PY_UINT64_T dict_version;
+    GuardDictPair pair;
+} GuardModuleAttrLink;
+
+typedef struct {
+    PyFuncGuardObject base;
+    GuardState state;
+    PyObject *name;
+    /* tuple of interned attribute names */
+    PyObject *attrs;
+    /* 1 + len(attrs) links: globals, then one per attribute */
+    Py_ssize_t nlink;
+    GuardModuleAttrLink *links;
+    /* 1 if bound to the globals of the specialized function */
+    int bound;
+} GuardModuleAttrObject;
+
+static int
+guard_module_attr_init_guard(PyObject *self, PyObject *func)
+{
+    GuardModuleAttrObject *guard = (GuardModuleAttrObject *)self;
+
+    if (guard->nlink == 0) {
+        /* guard not initialized */
+        return 1;
+    }
+    return guard_globals_bind(func, guard->links[0].dict, &guard->bound);
+}
+
+static int
+check_module_attr_guard(GuardModuleAttrObject *guard)
+{
+    Py_ssize_t i;
+
+    if (unlikely(!guard->bound)) {
+        PyThreadState *tstate;
+        PyFrameObject *frame;
+
+        tstate = PyThreadState_GET();
+        assert(tstate != NULL);
+
+        frame = tstate->frame;
+        assert(frame != NULL);
+
+        if (frame->f_globals != guard->links[0].dict)
+            return 2;
+    }
+
+    for (i=0; i < guard->nlink; i++) {
+        GuardModuleAttrLink *link = &guard->links[i];
+        PY_UINT64_T dict_version;
+
+        dict_version = ((PyDictObject *)link->dict)->ma_version_tag;
+        if (unlikely(dict_version != link->dict_version)) {
+            /* the dict was modified: check the key. If the module is
+               unchanged, so is its dict. */
+            int res = check_dict_pair_guard(link->dict, &link->pair);
+            if (res)
+                return res;
+            link->dict_version = dict_version;
+        }
+    }
+    return 0;
+}
+
+static int
+guard_module_attr_check(PyObject *self, PyObject **stack, Py_ssize_t nargs,
+                        PyObject *kwnames)
+{
+    int res = check_module_attr_guard((GuardModuleAttrObject *)self);
+    return GUARD_CHECK_RESULT(self, guard_module_attr_stats, res);
+}
+
+static void
+module_attr_links_clear(GuardModuleAttrLink *links, Py_ssize_t nlink)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < nlink; i++) {
+        Py_CLEAR(links[i].dict);
+        guard_dict_pair_dealloc(&links[i].pair);
+    }
+    PyMem_Free(links);
+}
+
+static void
+guard_module_attr_clear(GuardModuleAttrObject *guard)
+{
+    module_attr_links_clear(guard->links, guard->nlink);
+    guard->nlink = 0;
+    guard->links = NULL;
+    Py_CLEAR(guard->name);
+    Py_CLEAR(guard->attrs);
+}
+
+static void
+guard_module_attr_dealloc(GuardModuleAttrObject *self)
+{
+    guard_module_attr_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_module_attr_traverse(GuardModuleAttrObject *guard, visitproc visit,
+                           void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(guard->name);
+    Py_VISIT(guard->attrs);
+    for (i=0; i < guard->nlink; i++) {
+        Py_VISIT(guard->links[i].dict);
+        Py_VISIT(guard->links[i].pair.value);
+    }
+    return 0;
+}
+
+static PyObject *
+guard_module_attr_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardModuleAttrObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardModuleAttrObject *)op;
+    guard_state_init(op);
+    self->base.init = guard_module_attr_init_guard;
+    self->base.check = guard_module_attr_check;
+    self->name = NULL;
+    self->attrs = NULL;
+    self->nlink = 0;
+    self->links = NULL;
+    self->bound = 0;
+
+    return op;
+}
+
+/* Convert attr_path, a dotted str or a tuple of str, to a new tuple of
+   interned str */
+static PyObject*
+module_attr_parse_path(PyObject *attr_path)
+{
+    PyObject *seq, *attrs = NULL;
+    Py_ssize_t i, size;
+
+    if (PyUnicode_Check(attr_path)) {
+        PyObject *sep;
+
+        sep = PyUnicode_FromString(".");
+        if (sep == NULL)
+            return NULL;
+        seq = PyUnicode_Split(attr_path, sep, -1);
+        Py_DECREF(sep);
+        if (seq == NULL)
+            return NULL;
+    }
+    else if (PyTuple_Check(attr_path)) {
+        seq = attr_path;
+        Py_INCREF(seq);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "attr_path must be a str or a tuple, not %s",
+                     Py_TYPE(attr_path)->tp_name);
+        return NULL;
+    }
+
+    size = PySequence_Fast_GET_SIZE(seq);
+    if (size == 0) {
+        PyErr_SetString(PyExc_ValueError, "empty attr_path");
+        goto error;
+    }
+
+    attrs = PyTuple_New(size);
+    if (attrs == NULL)
+        goto error;
+
+    for (i=0; i < size; i++) {
+        PyObject *attr = PySequence_Fast_GET_ITEM(seq, i);
+
+        if (!PyUnicode_Check(attr)) {
+            PyErr_Format(PyExc_TypeError,
+                         "attribute name must be str, not %s",
+                         Py_TYPE(attr)->tp_name);
+            goto error;
+        }
+        if (PyUnicode_GET_LENGTH(attr) == 0) {
+            PyErr_SetString(PyExc_ValueError, "empty attribute name");
+            goto error;
+        }
+
+        Py_INCREF(attr);
+        PyUnicode_InternInPlace(&attr);
+        PyTuple_SET_ITEM(attrs, i, attr);
+    }
+    Py_DECREF(seq);
+    return attrs;
+
+error:
+    Py_DECREF(seq);
+    Py_XDECREF(attrs);
+    return NULL;
+}
+
+/* Initialize link with the current value of dict[key]. Return 0 on
+   success, -1 on error. */
+static int
+module_attr_link_init(GuardModuleAttrLink *link, PyObject *dict,
+                      PyObject *key)
+{
+    Py_hash_t hash;
+    PyObject *value;
+
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return -1;
+
+    value = PyDict_GetItemWithError(dict, key);
+    if (value == NULL && PyErr_Occurred())
+        return -1;
+
+    Py_INCREF(dict);
+    link->dict = dict;
+    link->dict_version = ((PyDictObject *)dict)->ma_version_tag;
+    Py_INCREF(key);
+    link->pair.key = key;
+    link->pair.hash = hash;
+    Py_XINCREF(value);
+    link->pair.value = value;
+    if (value != NULL && PyDict_CheckExact(dict))
+        link->pair.index = dict_find_entry((PyDictObject *)dict, key);
+    else
+        link->pair.index = -1;
+    link->pair.watcher_index = -1;
+    return 0;
+}
+
+static int
+guard_module_attr_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardModuleAttrObject *self = (GuardModuleAttrObject *)op;
+    static char *keywords[] = {"global_name", "attr_path", NULL};
+    PyObject *name, *attr_path, *attrs = NULL;
+    PyObject *dict;
+    GuardModuleAttrLink *links = NULL;
+    Py_ssize_t nlink, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "UO:GuardModuleAttr", keywords,
+                                     &name, &attr_path))
+        return -1;
+
+    attrs = module_attr_parse_path(attr_path);
+    if (attrs == NULL)
+        return -1;
+
+    dict = PyEval_GetGlobals();
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        goto error;
+    }
+
+    nlink = 1 + PyTuple_GET_SIZE(attrs);
+    if (nlink > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(links[0])) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    /* zeroed: unused links are skipped by module_attr_links_clear() */
+    links = PyMem_Calloc(nlink, sizeof(links[0]));
+    if (links == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    Py_INCREF(name);
+    PyUnicode_InternInPlace(&name);
+
+    for (i=0; i < nlink; i++) {
+        PyObject *key, *value;
+
+        key = (i == 0) ? name : PyTuple_GET_ITEM(attrs, i - 1);
+        if (module_attr_link_init(&links[i], dict, key) < 0) {
+            Py_DECREF(name);
+            goto error;
+        }
+
+        if (i == nlink - 1)
+            break;
+
+        /* intermediate values must be modules */
+        value = links[i].pair.value;
+        if (value == NULL) {
+            if (i == 0)
+                PyErr_Format(PyExc_NameError,
+                             "name %R is not defined", key);
+            else
+                PyErr_Format(PyExc_AttributeError,
+                             "module %R has no attribute %R",
+                             links[i - 1].pair.key, key);
+            Py_DECREF(name);
+            goto error;
+        }
+        if (!PyModule_Check(value)) {
+            PyErr_Format(PyExc_TypeError,
+                         "%R must be a module, not %s",
+                         key, Py_TYPE(value)->tp_name);
+            Py_DECREF(name);
+            goto error;
+        }
+        dict = PyModule_GetDict(value);
+    }
+
+    guard_module_attr_clear(self);
+    self->name = name;
+    self->attrs = attrs;
+    self->nlink = nlink;
+    self->links = links;
+    self->bound = 0;
+    return 0;
+
+error:
+    if (links != NULL)
+        module_attr_links_clear(links, nlink);
+    Py_XDECREF(attrs);
+    return -1;
+}
+
+static PyObject*
+guard_module_attr_get_globals(GuardModuleAttrObject *self)
+{
+    PyObject *globals;
+
+    if (self->nlink == 0)
+        Py_RETURN_NONE;
+    globals = self->links[0].dict;
+    Py_INCREF(globals);
+    return globals;
+}
+
+static PyGetSetDef guard_module_attr_getsetlist[] = {
+    {"globals", (getter)guard_module_attr_get_globals},
+    GUARD_GETSET
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_module_attr_members[] = {
+    {"global_name", T_OBJECT, offsetof(GuardModuleAttrObject, name),
+     RESTRICTED|READONLY},
+    {"attrs", T_OBJECT, offsetof(GuardModuleAttrObject, attrs),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_module_attr_doc,
+"GuardModuleAttr(global_name, attr_path)\n"
+"\n"
+"Guard on globals()[global_name].attr1.attr2... where attr_path is a\n"
+"dotted str like 'path.join', or a tuple of str. Intermediate values\n"
+"must be modules. Only dict versions are checked, until globals or\n"
+"the dict of a module on the path is modified.");
+
+static PyTypeObject GuardModuleAttr_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardModuleAttr",
+    sizeof(GuardModuleAttrObject),
+    0,
+    (destructor)guard_module_attr_dealloc,      /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_module_attr_doc,                      /* tp_doc */
+    (traverseproc)guard_module_attr_traverse,   /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_module_attr_members,                  /* tp_members */
+    guard_module_attr_getsetlist,               /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_module_attr_init,                     /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_module_attr_new,                      /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* Functions */
+
+static PyObject*
+fat_guard_type_dict(PyObject *self, PyObject *args)
+{
+    PyObject *type, *attrs, *seq, *guard_args, *guard;
+    Py_ssize_t n, i;
+
+    if (!PyArg_ParseTuple(args, "O!O:guard_type_dict", &PyType_Type, &type, &attrs))
+        return NULL;
+
+    if (PyUnicode_Check(attrs)) {
+        /* single attribute */
+        return PyObject_CallFunctionObjArgs((PyObject *)&GuardType_Type,
+                                            type, attrs, NULL);
+    }
+
+    seq = PySequence_Fast(attrs, "attrs must be a str or an iterable");
+    if (seq == NULL)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    guard_args = PyTuple_New(1 + n);
+    if (guard_args == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    Py_INCREF(type);
+    PyTuple_SET_ITEM(guard_args, 0, type);
+    for (i=0; i < n; i++) {
+        PyObject *attr = PySequence_Fast_GET_ITEM(seq, i);
+        Py_INCREF(attr);
+        PyTuple_SET_ITEM(guard_args, 1 + i, attr);
+    }
+    Py_DECREF(seq);
+
+    guard = PyObject_Call((PyObject *)&GuardType_Type, guard_args, NULL);
+    Py_DECREF(guard_args);
+    return guard;
+}
+
+PyDoc_STRVAR(guard_type_dict_doc,
+"guard_type_dict(type, attrs) -> GuardType\n"
+"\n"
+"Guard on type.attr for all attrs.");
+
+/* Cache of guards created by guard_globals_cached() and
+   guard_builtins_cached():
+   (guard type, globals address, builtins address, keys, max_fails)
+   => weak reference to the guard.
+   The cache doesn't keep guards alive, so it doesn't keep the globals of a
+   module alive. A live guard holds a strong reference to its dicts, so
+   dict addresses of entries of live guards are unique. */
+static PyObject *guard_cache = NULL;
+
+/* Minimum size of the guard cache to evict entries of dead guards */
+#define GUARD_CACHE_EVICT_MIN 64
+
+/* Evict entries of dead guards when the cache reaches this size */
+static Py_ssize_t guard_cache_evict_size = GUARD_CACHE_EVICT_MIN;
+
+/* Remove entries of guards which were destroyed */
+static int
+guard_cache_evict(void)
+{
+    PyObject *unused, *key, *ref;
+    Py_ssize_t pos = 0, i;
+
+    unused = PyList_New(0);
+    if (unused == NULL)
+        return -1;
+
+    while (PyDict_Next(guard_cache, &pos, &key, &ref)) {
+        if (PyWeakref_GET_OBJECT(ref) == Py_None
+            && PyList_Append(unused, key) < 0)
+            goto error;
+    }
+
+    for (i=0; i < PyList_GET_SIZE(unused); i++) {
+        if (PyDict_DelItem(guard_cache, PyList_GET_ITEM(unused, i)) < 0)
+            goto error;
+    }
+    Py_DECREF(unused);
+
+    guard_cache_evict_size = Py_MAX(PyDict_Size(guard_cache) * 2,
+                                    GUARD_CACHE_EVICT_MIN);
+    return 0;
+
+error:
+    Py_DECREF(unused);
+    return -1;
+}
+
+/* Check if a cached guard still passes for the current values of its dicts.
+   Return 0 if it passes, 2 if it fails, or -1 on error. */
+static int
+guard_cache_check(PyObject *guard)
+{
+    GuardState *state = &((GuardObject *)guard)->state;
+
+    if (state->max_fails != 0 && state->nfail >= state->max_fails) {
+        /* the guard gave up */
+        return 2;
+    }
+
+    if (Py_TYPE(guard) == &GuardBuiltins_Type) {
+        GuardBuiltinsObject *builtins_guard = (GuardBuiltinsObject *)guard;
+        PY_UINT64_T globals_version, builtins_version;
+
+        if (builtins_guard->init_failed == 1)
+            return 2;
+
+        globals_version =
+            ((PyDictObject *)builtins_guard->globals)->ma_version_tag;
+        builtins_version =
+            ((PyDictObject *)builtins_guard->base.dict)->ma_version_tag;
+        return check_builtins_pairs(builtins_guard,
+                                    globals_version, builtins_version);
+    }
+
+    return check_dict_guard((GuardDictObject *)guard);
+}
+
+static PyObject*
+guard_cached(PyTypeObject *type, PyObject *keys)
+{
+    PyObject *globals, *builtins = NULL;
+    PyObject *globals_id, *builtins_id;
+    PyObject *key, *ref, *guard;
+    int res;
+
+    globals = PyEval_GetGlobals();
+    if (globals == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return NULL;
+    }
+    if (type == &GuardBuiltins_Type) {
+        builtins = PyEval_GetBuiltins();
+        if (builtins == NULL) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "unable to get builtins");
+            return NULL;
+        }
+    }
+
+    if (guard_cache == NULL) {
+        guard_cache = PyDict_New();
+        if (guard_cache == NULL)
+            return NULL;
+    }
+
+    globals_id = PyLong_FromVoidPtr(globals);
+    if (globals_id == NULL)
+        return NULL;
+    builtins_id = PyLong_FromVoidPtr(builtins);
+    if (builtins_id == NULL) {
+        Py_DECREF(globals_id);
+        return NULL;
+    }
+
+    key = Py_BuildValue("(ONNOn)",
+                        (PyObject *)type,
+                        globals_id,
+                        builtins_id,
+                        keys,
+                        default_max_fails);
+    if (key == NULL)
+        return NULL;
+
+    ref = PyDict_GetItemWithError(guard_cache, key);
+    if (ref != NULL) {
+        guard = PyWeakref_GET_OBJECT(ref);
+        if (guard != Py_None) {
+            Py_INCREF(guard);
+            res = guard_cache_check(guard);
+            if (res == 0) {
+                Py_DECREF(key);
+                return guard;
+            }
+            Py_DECREF(guard);
+            if (res < 0) {
+                Py_DECREF(key);
+                return NULL;
+            }
+            /* a watched key was modified since the guard was created:
+               replace the guard with a new guard */
+        }
+        /* else the guard was destroyed: replace the entry */
+    }
+    else if (PyErr_Occurred()) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    else if (PyDict_Size(guard_cache) >= guard_cache_evict_size) {
+        if (guard_cache_evict() < 0) {
+            Py_DECREF(key);
+            return NULL;
+        }
+    }
+
+    guard = PyObject_Call((PyObject *)type, keys, NULL);
+    if (guard == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    ref = PyWeakref_NewRef(guard, NULL);
+    if (ref == NULL) {
+        Py_DECREF(key);
+        Py_DECREF(guard);
+        return NULL;
+    }
+    res = PyDict_SetItem(guard_cache, key, ref);
+    Py_DECREF(key);
+    Py_DECREF(ref);
+    if (res < 0) {
+        Py_DECREF(guard);
+        return NULL;
+    }
+    return guard;
+}
+
+static PyObject*
+fat_guard_globals_cached(PyObject *self, PyObject *args)
+{
+    return guard_cached(&GuardGlobals_Type, args);
+}
+
+PyDoc_STRVAR(guard_globals_cached_doc,
+"guard_globals_cached(*keys) -> GuardGlobals\n"
+"\n"
+"Get a GuardGlobals guard shared by all callers using the same globals\n"
+"and the same keys. A new guard replaces the cached guard if a key was\n"
+"modified since the cached guard was created.\n"
+"\n"
+"The state of the guard is shared by all callers: max_fails, the number\n"
+"of consecutive failures and statistics.");
+
+static PyObject*
+fat_guard_builtins_cached(PyObject *self, PyObject *args)
+{
+    return guard_cached(&GuardBuiltins_Type, args);
+}
+
+PyDoc_STRVAR(guard_builtins_cached_doc,
+"guard_builtins_cached(*keys) -> GuardBuiltins\n"
+"\n"
+"Get a GuardBuiltins guard shared by all callers using the same globals,\n"
+"the same builtins and the same keys. A new guard replaces the cached\n"
+"guard if a key was modified since the cached guard was created.\n"
+"\n"
+"The state of the guard is shared by all callers: max_fails, the number\n"
+"of consecutive failures and statistics.");
+
+static PyObject*
+fat_clear_guard_cache(PyObject *self, PyObject *noargs)
+{
+    Py_CLEAR(guard_cache);
+    guard_cache_evict_size = GUARD_CACHE_EVICT_MIN;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(clear_guard_cache_doc,
+"clear_guard_cache()\n"
+"\n"
+"Clear the cache of guard_globals_cached() and guard_builtins_cached().\n"
+"The cache only holds weak references to guards, entries of destroyed\n"
+"guards are also removed when the cache grows.");
+
+
+
+/* Maximum size of a mapping for which replace_consts() compares hashes of
+   constants to hashes of the mapping keys, rather than looking up each
+   constant in the mapping */
+#define REPLACE_CONSTS_SMALL_MAPPING 8
+
+/* Replace constants using the mapping: old constant => new constant.
+   Unhashable constants are not replaced.
+
+   Return a new reference to consts if no constant was replaced. */
+static PyObject*
+replace_consts(PyObject *consts, PyObject *mapping)
+{
+    PyObject *new_consts = NULL, *value, *new_value, *key, *unused;
+    Py_hash_t hashes[REPLACE_CONSTS_SMALL_MAPPING];
+    Py_hash_t hash;
+    Py_ssize_t i, j, size, nhash, pos;
+
+    assert(PyTuple_CheckExact(consts));
+    assert(PyDict_Check(mapping));
+    size = PyTuple_GET_SIZE(consts);
+
+    nhash = PyDict_Size(mapping);
+    if (nhash == 0 || size == 0) {
+        Py_INCREF(consts);
+        return consts;
+    }
+
+    if (nhash <= REPLACE_CONSTS_SMALL_MAPPING) {
+        /* read hashes stored in the dict: no Python code is called,
+           the mapping cannot be modified */
+        pos = 0;
+        j = 0;
+        while (j < nhash && _PyDict_Next(mapping, &pos, &key, &unused, &hash))
+            hashes[j++] = hash;
+        nhash = j;
+    }
+    else {
+        nhash = 0;
+    }
+
+    for (i=0; i<size; i++) {
+        value = PyTuple_GET_ITEM(consts, i);
+
+        hash = PyObject_Hash(value);
+        if (hash == -1) {
+            if (!PyErr_ExceptionMatches(PyExc_TypeError))
+                goto error;
+            /* unhashable constant */
+            PyErr_Clear();
+            continue;
+        }
+
+        if (nhash != 0) {
+            /* cheap filter: the constant cannot be a key of the mapping
+               if no key has the same hash */
+            for (j=0; j < nhash; j++) {
+                if (hashes[j] == hash)
+                    break;
+            }
+            if (j == nhash)
+                continue;
+        }
+
+        new_value = _PyDict_GetItem_KnownHash(mapping, value, hash);
+        if (new_value == NULL) {
+            if (PyErr_Occurred())
+                goto error;
+            continue;
+        }
+        if (new_value == value)
+            continue;
+
+        if (new_consts == NULL) {
+            /* first replaced constant: copy the tuple */
+            new_consts = PyTuple_New(size);
+            if (new_consts == NULL)
+                return NULL;
+            for (j=0; j < size; j++) {
+                PyObject *item = PyTuple_GET_ITEM(consts, j);
+                Py_INCREF(item);
+                PyTuple_SET_ITEM(new_consts, j, item);
+            }
+        }
+
+        Py_INCREF(new_value);
+        Py_SETREF(PyTuple_GET_ITEM(new_consts, i), new_value);
+    }
+
+    if (new_consts == NULL) {
+        Py_INCREF(consts);
+        return consts;
+    }
+    return new_consts;
+
+error:
+    Py_XDECREF(new_consts);
+    return NULL;
+}
+
+/* Get the index of value in the list of constants, append it if needed.
+   Constants are compared by identity. Return -1 on error. */
+static Py_ssize_t
+consts_index(PyObject *consts, PyObject *value)
+{
+    Py_ssize_t i, size;
+
+    size = PyList_GET_SIZE(consts);
+    for (i=0; i < size; i++) {
+        if (PyList_GET_ITEM(consts, i) == value)
+            return i;
+    }
+    if (PyList_Append(consts, value) < 0)
+        return -1;
+    return size;
+}
+
+/* Replace LOAD_GLOBAL instructions loading a name of the names mapping
+   (name => value) with LOAD_CONST of the value, in a single pass on the
+   bytecode. Values are appended to the consts list if needed.
+
+   Instructions are replaced in place, so jumps and the line number table
+   are unchanged: unused EXTENDED_ARG prefixes are replaced with NOP. A
+   load is kept if the index of the constant doesn't fit into the
+   instruction.
+
+   Return a new reference to the original bytecode if no instruction was
+   replaced. */
+static PyObject*
+replace_global_loads(PyCodeObject *code, PyObject *consts, PyObject *names)
+{
+    PyObject *bytecode = NULL;
+    const unsigned char *instrs;
+    unsigned char *new_instrs = NULL;
+    Py_ssize_t size, i, start, index, nunit, nunit_needed, k;
+    unsigned long oparg;
+    PyObject *name, *value;
+
+    assert(PyBytes_CheckExact(code->co_code));
+    instrs = (const unsigned char *)PyBytes_AS_STRING(code->co_code);
+    size = PyBytes_GET_SIZE(code->co_code);
+
+    oparg = 0;
+    start = 0;
+    for (i=0; i + 1 < size; i += 2) {
+        unsigned char op = instrs[i];
+
+        oparg = (oparg << 8) | instrs[i+1];
+        if (op == EXTENDED_ARG)
+            continue;
+
+        if (op == LOAD_GLOBAL
+            && oparg < (unsigned long)PyTuple_GET_SIZE(code->co_names)) {
+            name = PyTuple_GET_ITEM(code->co_names, oparg);
+            value = PyDict_GetItemWithError(names, name);
+            if (value == NULL && PyErr_Occurred())
+                goto error;
+
+            if (value != NULL) {
+                index = consts_index(consts, value);
+                if (index < 0)
+                    goto error;
+
+                nunit = (i - start) / 2 + 1;
+                nunit_needed = 1;
+                while (nunit_needed < 4 && (index >> (8 * nunit_needed)))
+                    nunit_needed++;
+
+                if (nunit_needed <= nunit) {
+                    if (bytecode == NULL) {
+                        bytecode = PyBytes_FromStringAndSize((const char *)instrs,
+                                                             size);
+                        if (bytecode == NULL)
+                            goto error;
+                        new_instrs = (unsigned char *)PyBytes_AS_STRING(bytecode);
+                    }
+
+                    for (k=0; k < nunit - nunit_needed; k++) {
+                        new_instrs[start + k * 2] = NOP;
+                        new_instrs[start + k * 2 + 1] = 0;
+                    }
+                    for (k=nunit_needed - 1; k >= 0; k--) {
+                        Py_ssize_t pos = i - k * 2;
+                        new_instrs[pos] = (k == 0) ? LOAD_CONST : EXTENDED_ARG;
+                        new_instrs[pos + 1] = (index >> (8 * k)) & 0xff;
+                    }
+                }
+            }
+        }
+
+        oparg = 0;
+        start = i + 2;
+    }
+
+    if (bytecode == NULL) {
+        Py_INCREF(code->co_code);
+        return code->co_code;
+    }
+    return bytecode;
+
+error:
+    Py_XDECREF(bytecode);
+    return NULL;
+}
+
+/* Create a copy of code with constants replaced using the mapping and
+   loads of global names replaced with constants using names, if names is
+   not NULL */
+static PyObject *
+code_replace_consts(PyCodeObject *code, PyObject *mapping, PyObject *names)
+{
+    PyObject *new_consts, *bytecode, *new_code;
+
+    new_consts = replace_consts(code->co_consts, mapping);
+    if (new_consts == NULL)
+        return NULL;
+
+    bytecode = code->co_code;
+    Py_INCREF(bytecode);
+
+    if (names != NULL && PyDict_Size(names) != 0) {
+        PyObject *list, *new_bytecode;
+
+        list = PySequence_List(new_consts);
+        if (list == NULL)
+            goto error;
+
+        new_bytecode = replace_global_loads(code, list, names);
+        if (new_bytecode == NULL) {
+            Py_DECREF(list);
+            goto error;
+        }
+
+        if (new_bytecode != bytecode) {
+            Py_SETREF(bytecode, new_bytecode);
+            Py_SETREF(new_consts, PyList_AsTuple(list));
+        }
+        else {
+            Py_DECREF(new_bytecode);
+        }
+        Py_DECREF(list);
+        if (new_consts == NULL)
+            goto error;
+    }
+
+    if (new_consts == code->co_consts && bytecode == code->co_code) {
+        /* nothing was replaced */
+        Py_DECREF(new_consts);
+        Py_DECREF(bytecode);
+        Py_INCREF(code);
+        return (PyObject *)code;
+    }
+
+    new_code = (PyObject *)PyCode_New(
+        code->co_argcount,
+        code->co_kwonlyargcount,
+        code->co_nlocals,
+        code->co_stacksize,
+        code->co_flags,
+        bytecode,                  /* replace global loads */
+        new_consts,                /* replace constants */
+        code->co_names,
+        code->co_varnames,
+        code->co_freevars,
+        code->co_cellvars,
+        code->co_filename,
+        code->co_name,
+        code->co_firstlineno,
+        code->co_lnotab);
+    Py_DECREF(bytecode);
+    Py_DECREF(new_consts);
+
+    return new_code;
+
+error:
+    Py_XDECREF(new_consts);
+    Py_DECREF(bytecode);
+    return NULL;
+}
+
+static int
+parse_replace_consts_args(PyObject *args, PyObject *kwargs, const char *format,
+                          PyCodeObject **code, PyObject **mapping,
+                          PyObject **names)
+{
+    static char *keywords[] = {"code", "mapping", "names", NULL};
+
+    *names = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, format, keywords,
+                                     &PyCode_Type, code,
+                                     &PyDict_Type, mapping,
+                                     names))
+        return -1;
+
+    if (*names == Py_None) {
+        *names = NULL;
+    }
+    else if (*names != NULL && !PyDict_Check(*names)) {
+        PyErr_Format(PyExc_TypeError,
+                     "names must be a dict or None, not %s",
+                     Py_TYPE(*names)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+fat_replace_consts(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyCodeObject *code;
+    PyObject *mapping, *names;
+
+    if (parse_replace_consts_args(args, kwargs, "O!O!|O:replace_consts",
+                                  &code, &mapping, &names) < 0)
+        return NULL;
+
+    return code_replace_consts(code, mapping, names);
+}
+
+PyDoc_STRVAR(patch_constants_doc,
+"replace_consts(code, mapping, names=None) -> code\n"
+"\n"
+"Create a new code object with new constants using the constant mapping:\n"
+"old constant value => new constant value. Return code if nothing was\n"
+"replaced.\n"
+"\n"
+"If names is set, loads of global names are also replaced with constants\n"
+"using the names mapping: global name => constant value.");
+
+/* Cache of code objects created by replace_consts_cached():
+   (code, filename, lnotab, mapping key, names key)
+   => (new code, mapping, names).
+
+   Code objects are compared by value, so equal functions of reloaded
+   modules share the same code object. Items of mappings are compared by
+   key type, key and value address: copies of mappings are kept in the
+   cache to keep values alive. */
+static PyObject *code_cache = NULL;
+
+/* Create a frozenset of (type(key), key, id(value)) items */
+static PyObject*
+mapping_cache_key(PyObject *mapping)
+{
+    PyObject *items, *item, *key, *value, *set;
+    Py_ssize_t pos;
+
+    if (mapping == NULL) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    items = PyList_New(0);
+    if (items == NULL)
+        return NULL;
+
+    pos = 0;
+    while (PyDict_Next(mapping, &pos, &key, &value)) {
+        item = Py_BuildValue("(OOn)",
+                             (PyObject *)Py_TYPE(key), key,
+                             (Py_ssize_t)value);
+        if (item == NULL)
+            goto error;
+        if (PyList_Append(items, item) < 0) {
+            Py_DECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    set = PyFrozenSet_New(items);
+    Py_DECREF(items);
+    return set;
+
+error:
+    Py_DECREF(items);
+    return NULL;
+}
+
+static PyObject *
+fat_replace_consts_cached(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyCodeObject *code;
+    PyObject *mapping, *names;
+    PyObject *key = NULL, *mapping_key = NULL, *names_key = NULL;
+    PyObject *entry, *new_code = NULL;
+    PyObject *mapping_copy = NULL, *names_copy = NULL;
+
+    if (parse_replace_consts_args(args, kwargs,
+                                  "O!O!|O:replace_consts_cached",
+                                  &code, &mapping, &names) < 0)
+        return NULL;
+
+    if (code_cache == NULL) {
+        code_cache = PyDict_New();
+        if (code_cache == NULL)
+            return NULL;
+    }
+
+    mapping_key = mapping_cache_key(mapping);
+    if (mapping_key == NULL)
+        goto error;
+    names_key = mapping_cache_key(names);
+    if (names_key == NULL)
+        goto error;
+
+    key = PyTuple_Pack(5, (PyObject *)code, code->co_filename,
+                       code->co_lnotab, mapping_key, names_key);
+    if (key == NULL)
+        goto error;
+
+    entry = PyDict_GetItemWithError(code_cache, key);
+    if (entry != NULL) {
+        new_code = PyTuple_GET_ITEM(entry, 0);
+        Py_INCREF(new_code);
+        goto done;
+    }
+    if (PyErr_Occurred())
+        goto error;
+
+    new_code = code_replace_consts(code, mapping, names);
+    if (new_code == NULL)
+        goto error;
+
+    mapping_copy = PyDict_Copy(mapping);
+    if (mapping_copy == NULL)
+        goto error;
+    if (names != NULL) {
+        names_copy = PyDict_Copy(names);
+        if (names_copy == NULL)
+            goto error;
+    }
+    else {
+        names_copy = Py_None;
+        Py_INCREF(names_copy);
+    }
+
+    entry = PyTuple_Pack(3, new_code, mapping_copy, names_copy);
+    if (entry == NULL)
+        goto error;
+    if (PyDict_SetItem(code_cache, key, entry) < 0) {
+        Py_DECREF(entry);
+        goto error;
+    }
+    Py_DECREF(entry);
+
+done:
+    Py_DECREF(key);
+    Py_DECREF(mapping_key);
+    Py_DECREF(names_key);
+    Py_XDECREF(mapping_copy);
+    Py_XDECREF(names_copy);
+    return new_code;
+
+error:
+    Py_XDECREF(key);
+    Py_XDECREF(mapping_key);
+    Py_XDECREF(names_key);
+    Py_XDECREF(mapping_copy);
+    Py_XDECREF(names_copy);
+    Py_XDECREF(new_code);
+    return NULL;
+}
+
+PyDoc_STRVAR(replace_consts_cached_doc,
+"replace_consts_cached(code, mapping, names=None) -> code\n"
+"\n"
+"Similar to replace_consts(), but return the same code object for equal\n"
+"code objects and mappings with the same values.");
 
 static PyObject*
-fat_guard_type_dict(PyObject *self, PyObject *args)
+fat_clear_code_cache(PyObject *self, PyObject *noargs)
+{
+    Py_CLEAR(code_cache);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(clear_code_cache_doc,
+"clear_code_cache()\n"
+"\n"
+"Clear the cache of replace_consts_cached(): cached code objects keep\n"
+"their constants alive.");
+
+
+static PyObject *
+fat_specialize(PyObject *self, PyObject *args)
 {
-    PyObject *type, *type_dict, *keys;
+    PyObject *func, *code, *guards;
+    int res;
 
-    if (!PyArg_ParseTuple(args, "O!O:guard_type_dict", &PyType_Type, &type, &keys))
+    if (!PyArg_ParseTuple(args, "O!OO:specialize",
+                          &PyFunction_Type, &func, &code, &guards))
         return NULL;
 
-    type_dict = ((PyTypeObject*)type)->tp_dict;
-    assert(type_dict != NULL);
+    res = PyFunction_Specialize(func, code, guards);
+    if (res < 0)
+        return NULL;
 
-    return PyObject_CallFunction((PyObject *)&GuardDict_Type, "OO", type_dict, keys);
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(guard_type_dict_doc,
-"guard_type_dict(attrs) -> GuardDict\n"
+PyDoc_STRVAR(specialize_doc,
+"specialize(func, code, guards) -> bool\n"
 "\n"
-"Guard on type.attr (type.__dict__[attr]) for all attrs.");
+"Specialize a function: add a specialized code with guards.");
 
 
+/* Get the key used to share a guard between the specializations of a
+   batch: dict guards of the same type watching the same keys of the same
+   dicts, created with the same values, are equivalent. Return a new
+   reference, Py_None if the guard cannot be shared, or NULL on error. */
 static PyObject*
-replace_consts(PyObject *consts, PyObject *mapping)
+guard_share_key(PyObject *guard)
 {
-    PyObject *new_consts, *value, *new_value;
-    Py_ssize_t i, size;
-
-    assert(PyTuple_CheckExact(consts));
-    assert(PyDict_Check(mapping));
-    size = PyTuple_GET_SIZE(consts);
+    PyTypeObject *type = Py_TYPE(guard);
+    GuardDictObject *dict_guard;
+    PyObject *globals = NULL, *keys, *values;
+    PyObject *dict_id = NULL, *globals_id = NULL;
+    int init_failed = 0;
+    Py_ssize_t i;
 
-    new_consts = PyTuple_New(size);
-    for (i=0; i<size; i++) {
-        value = PyTuple_GET_ITEM(consts, i);
+    if (type != &GuardDict_Type
+        && type != &GuardGlobals_Type
+        && type != &GuardBuiltins_Type)
+        Py_RETURN_NONE;
 
-        new_value = PyDict_GetItem(mapping, value);
-        if (new_value == NULL && PyErr_Occurred()) {
-            /* truncate the tuple to not read unitilized memory in
-               the tuple destructor */
-            Py_SIZE(new_consts) = i;
-            Py_DECREF(new_consts);
-            return NULL;
-        }
+    dict_guard = (GuardDictObject *)guard;
+    if (dict_guard->dict == NULL) {
+        /* guard not initialized */
+        Py_RETURN_NONE;
+    }
+    if (type == &GuardBuiltins_Type) {
+        globals = ((GuardBuiltinsObject *)guard)->globals;
+        init_failed = ((GuardBuiltinsObject *)guard)->init_failed;
+    }
 
-        if (new_value != NULL)
-            value = new_value;
+    keys = guard_dict_get_keys(dict_guard);
+    if (keys == NULL)
+        return NULL;
 
-        Py_INCREF(value);
-        PyTuple_SET_ITEM(new_consts, i, value);
+    /* guards of the batch hold a strong reference to their dicts and to
+       values, so addresses are unique during the batch */
+    values = PyTuple_New(dict_guard->npair);
+    if (values == NULL)
+        goto error;
+    for (i=0; i < dict_guard->npair; i++) {
+        PyObject *value_id = PyLong_FromVoidPtr(dict_guard->pairs[i].value);
+        if (value_id == NULL)
+            goto error;
+        PyTuple_SET_ITEM(values, i, value_id);
     }
 
-    return new_consts;
+    dict_id = PyLong_FromVoidPtr(dict_guard->dict);
+    if (dict_id == NULL)
+        goto error;
+    globals_id = PyLong_FromVoidPtr(globals);
+    if (globals_id == NULL)
+        goto error;
+
+    return Py_BuildValue("(ONNNNin)",
+                         (PyObject *)type,
+                         dict_id,
+                         globals_id,
+                         keys,
+                         values,
+                         init_failed,
+                         dict_guard->state.max_fails);
+
+error:
+    Py_DECREF(keys);
+    Py_XDECREF(values);
+    Py_XDECREF(dict_id);
+    Py_XDECREF(globals_id);
+    return NULL;
 }
 
-static PyObject *
-fat_replace_consts(PyObject *self, PyObject *args)
+/* Specialize a function using a (func, code, guards) entry. If shared is
+   not NULL, replace guards with equivalent guards of shared. */
+static int
+specialize_entry(PyObject *entry, PyObject *shared)
 {
-    PyCodeObject *code;
-    PyObject *mapping;
-    PyObject *new_consts, *new_code;
+    PyObject *func, *code, *guards;
+    PyObject *seq = NULL, *new_guards = NULL;
+    Py_ssize_t n, i;
+    int res;
 
-    if (!PyArg_ParseTuple(args, "O!O!:replace_consts",
-                          &PyCode_Type, &code,
-                          &PyDict_Type, &mapping))
-        return NULL;
+    if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) != 3) {
+        PyErr_Format(PyExc_TypeError,
+                     "entry must be a (func, code, guards) tuple, got %s",
+                     Py_TYPE(entry)->tp_name);
+        return -1;
+    }
+    func = PyTuple_GET_ITEM(entry, 0);
+    code = PyTuple_GET_ITEM(entry, 1);
+    guards = PyTuple_GET_ITEM(entry, 2);
 
-    new_consts = replace_consts(code->co_consts, mapping);
-    if (new_consts == NULL)
-        return NULL;
+    if (!PyFunction_Check(func)) {
+        PyErr_Format(PyExc_TypeError,
+                     "func must be a function, not %s",
+                     Py_TYPE(func)->tp_name);
+        return -1;
+    }
 
-    new_code = (PyObject *)PyCode_New(
-        code->co_argcount,
-        code->co_kwonlyargcount,
-        code->co_nlocals,
-        code->co_stacksize,
-        code->co_flags,
-        code->co_code,
-        new_consts,                /* replace constants */
-        code->co_names,
-        code->co_varnames,
-        code->co_freevars,
-        code->co_cellvars,
-        code->co_filename,
-        code->co_name,
-        code->co_firstlineno,
-        code->co_lnotab);
-    Py_DECREF(new_consts);
+    seq = PySequence_Fast(guards, "guards must be an iterable");
+    if (seq == NULL)
+        return -1;
 
-    return new_code;
-}
+    n = PySequence_Fast_GET_SIZE(seq);
+    new_guards = PyList_New(n);
+    if (new_guards == NULL)
+        goto error;
 
-PyDoc_STRVAR(patch_constants_doc,
-"replace_constants(code, mapping) -> code\n"
-"\n"
-"Create a new code object with new constants using the constant mapping:\n"
-"old constant value => new constant value.");
+    for (i=0; i < n; i++) {
+        PyObject *guard = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *key, *shared_guard;
+
+        if (shared == NULL) {
+            Py_INCREF(guard);
+            PyList_SET_ITEM(new_guards, i, guard);
+            continue;
+        }
+
+        key = guard_share_key(guard);
+        if (key == NULL)
+            goto error;
+
+        if (key != Py_None) {
+            shared_guard = PyDict_GetItemWithError(shared, key);
+            if (shared_guard != NULL) {
+                guard = shared_guard;
+            }
+            else if (PyErr_Occurred()
+                     || PyDict_SetItem(shared, key, guard) < 0) {
+                Py_DECREF(key);
+                goto error;
+            }
+        }
+        Py_DECREF(key);
+
+        Py_INCREF(guard);
+        PyList_SET_ITEM(new_guards, i, guard);
+    }
+    Py_CLEAR(seq);
 
+    res = PyFunction_Specialize(func, code, new_guards);
+    Py_DECREF(new_guards);
+    return res;
+
+error:
+    Py_XDECREF(new_guards);
+    Py_XDECREF(seq);
+    return -1;
+}
 
 static PyObject *
-fat_specialize(PyObject *self, PyObject *args)
+fat_specialize_many(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject *func, *code, *guards;
-    int res;
+    static char *keywords[] = {"entries", "share_guards", NULL};
+    PyObject *entries, *seq, *shared = NULL, *results = NULL;
+    int share_guards = 0;
+    Py_ssize_t n, i;
 
-    if (!PyArg_ParseTuple(args, "O!OO:specialize",
-                          &PyFunction_Type, &func, &code, &guards))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$p:specialize_many",
+                                     keywords, &entries, &share_guards))
         return NULL;
 
-    res = PyFunction_Specialize(func, code, guards);
-    if (res < 0)
+    seq = PySequence_Fast(entries, "entries must be an iterable");
+    if (seq == NULL)
         return NULL;
 
-    Py_RETURN_NONE;
+    if (share_guards) {
+        shared = PyDict_New();
+        if (shared == NULL)
+            goto error;
+    }
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    results = PyList_New(n);
+    if (results == NULL)
+        goto error;
+
+    for (i=0; i < n; i++) {
+        PyObject *entry = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *result;
+
+        if (specialize_entry(entry, shared) < 0) {
+            PyObject *exc_type, *exc_value, *exc_tb;
+
+            /* report the error and continue with the next entry */
+            PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+            PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+            if (exc_tb != NULL) {
+                PyException_SetTraceback(exc_value, exc_tb);
+                Py_DECREF(exc_tb);
+            }
+            Py_DECREF(exc_type);
+            result = exc_value;
+        }
+        else {
+            Py_INCREF(Py_None);
+            result = Py_None;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+
+    Py_XDECREF(shared);
+    Py_DECREF(seq);
+    return results;
+
+error:
+    Py_XDECREF(results);
+    Py_XDECREF(shared);
+    Py_DECREF(seq);
+    return NULL;
 }
 
-PyDoc_STRVAR(specialize_doc,
-"specialize(func, code, guards) -> bool\n"
+PyDoc_STRVAR(specialize_many_doc,
+"specialize_many(entries, *, share_guards=False) -> list\n"
 "\n"
-"Specialize a function: add a specialized code with guards.");
+"Specialize many functions: entries is an iterable of\n"
+"(func, code, guards) tuples.\n"
+"\n"
+"If share_guards is true, dict guards of the same type watching the same\n"
+"keys with the same values of the same dicts, with the same max_fails,\n"
+"are shared between functions: the first guard is used for all\n"
+"functions, the other guards are not attached. The state of a shared\n"
+"guard is shared by all functions: the number of consecutive failures\n"
+"and statistics.\n"
+"\n"
+"Return a list with one item per entry: None if the function was\n"
+"specialized, or the exception raised by the specialization.");
 
 
 static PyObject *
@@ -1171,15 +5508,247 @@ PyDoc_STRVAR(get_specialized_doc,
 "tuples where code is a callable or code object and guards is a list\n"
 "of guards.");
 
+static PyObject *
+fat_stats(PyObject *self, PyObject *noargs)
+{
+#ifndef FAT_NO_STATS
+    PyObject *stats, *value;
+    struct {
+        const char *name;
+        GuardStats *stats;
+    } types[] = {
+        {"GuardArgType", &guard_arg_type_stats},
+        {"GuardArgTypes", &guard_arg_types_stats},
+        {"GuardArgValue", &guard_arg_value_stats},
+        {"GuardArgIntRange", &guard_arg_int_range_stats},
+        {"GuardFunc", &guard_func_stats},
+        {"GuardCell", &guard_cell_stats},
+        {"GuardType", &guard_type_stats},
+        {"GuardInstanceShape", &guard_instance_shape_stats},
+        {"GuardDict", &guard_dict_stats},
+        {"GuardGlobals", &guard_globals_stats},
+        {"GuardBuiltins", &guard_builtins_stats},
+        {"GuardModuleAttr", &guard_module_attr_stats},
+    };
+    size_t i;
+
+    stats = PyDict_New();
+    if (stats == NULL)
+        return NULL;
+
+    for (i=0; i < Py_ARRAY_LENGTH(types); i++) {
+        int res;
+
+        value = guard_stats_as_dict(types[i].stats);
+        if (value == NULL) {
+            Py_DECREF(stats);
+            return NULL;
+        }
+        res = PyDict_SetItemString(stats, types[i].name, value);
+        Py_DECREF(value);
+        if (res < 0) {
+            Py_DECREF(stats);
+            return NULL;
+        }
+    }
+    return stats;
+#else
+    /* statistics are disabled at compilation */
+    Py_RETURN_NONE;
+#endif
+}
+
+PyDoc_STRVAR(stats_doc,
+"stats() -> dict\n"
+"\n"
+"Get the number of guard checks per guard type as a dict:\n"
+"type name => {'hit': int, 'miss': int, 'invalidate': int}.\n"
+"Return None if statistics are disabled at compilation.");
+
+static PyObject *
+fat_get_max_fails(PyObject *self, PyObject *noargs)
+{
+    return PyLong_FromSsize_t(default_max_fails);
+}
+
+PyDoc_STRVAR(get_max_fails_doc,
+"get_max_fails() -> int\n"
+"\n"
+"Get the default maximum number of consecutive failures of new guards.");
+
+static PyObject *
+fat_set_max_fails(PyObject *self, PyObject *args)
+{
+    Py_ssize_t max_fails;
+
+    if (!PyArg_ParseTuple(args, "n:set_max_fails", &max_fails))
+        return NULL;
+
+    if (max_fails < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_fails must be >= 0");
+        return NULL;
+    }
+
+    default_max_fails = max_fails;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_max_fails_doc,
+"set_max_fails(max_fails)\n"
+"\n"
+"Set the default maximum number of consecutive failures of new guards.\n"
+"When a guard fails max_fails times in a row, it gives up and\n"
+"always fails with 2 to remove the specialization. 0 means no limit.");
+
+static PyObject *
+fat_bench_check(PyObject *self, PyObject *args)
+{
+    PyObject *guards, *call_args = NULL, *dict = NULL;
+    Py_ssize_t number, nargs = 0, nguard, i, j;
+    Py_ssize_t mutate_every = 1, countdown;
+    PyObject *value;
+    PyObject **stack = NULL;
+    PyObject **guard_array;
+    PyObject *key = NULL;
+    _PyTime_t t0, t1, t2;
+    double dt;
+
+    if (!PyArg_ParseTuple(args, "On|O!On:_bench_check",
+                          &guards,
+                          &number,
+                          &PyTuple_Type, &call_args,
+                          &dict,
+                          &mutate_every))
+        return NULL;
+
+    if (dict == Py_None) {
+        dict = NULL;
+    }
+    else if (dict != NULL && !PyDict_Check(dict)) {
+        PyErr_Format(PyExc_TypeError,
+                     "dict must be a dict or None, not %s",
+                     Py_TYPE(dict)->tp_name);
+        return NULL;
+    }
+
+    if (PyTuple_Check(guards)) {
+        guard_array = &PyTuple_GET_ITEM(guards, 0);
+        nguard = PyTuple_GET_SIZE(guards);
+    }
+    else {
+        guard_array = &guards;
+        nguard = 1;
+    }
+    for (j=0; j < nguard; j++) {
+        if (!PyObject_TypeCheck(guard_array[j], &PyFuncGuard_Type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "guard must be a guard, not %s",
+                         Py_TYPE(guard_array[j])->tp_name);
+            return NULL;
+        }
+    }
+
+    if (number <= 0) {
+        PyErr_SetString(PyExc_ValueError, "number must be > 0");
+        return NULL;
+    }
+    if (mutate_every <= 0) {
+        PyErr_SetString(PyExc_ValueError, "mutate_every must be > 0");
+        return NULL;
+    }
+
+    if (call_args != NULL) {
+        stack = &PyTuple_GET_ITEM(call_args, 0);
+        nargs = PyTuple_GET_SIZE(call_args);
+    }
+
+    if (dict != NULL) {
+        /* modify an unrelated key every mutate_every iterations to change
+           the dict version */
+        key = PyUnicode_InternFromString("__fat_bench__");
+        if (key == NULL)
+            return NULL;
+    }
+
+    /* reference: loop and dict modification */
+    countdown = 1;
+    value = Py_True;
+    t0 = _PyTime_GetMonotonicClock();
+    for (i=0; i < number; i++) {
+        if (dict != NULL && --countdown == 0) {
+            countdown = mutate_every;
+            value = (value == Py_True) ? Py_False : Py_True;
+            if (PyDict_SetItem(dict, key, value) < 0)
+                goto error;
+        }
+    }
+    t1 = _PyTime_GetMonotonicClock();
+
+    countdown = 1;
+    value = Py_True;
+    for (i=0; i < number; i++) {
+        if (dict != NULL && --countdown == 0) {
+            countdown = mutate_every;
+            value = (value == Py_True) ? Py_False : Py_True;
+            if (PyDict_SetItem(dict, key, value) < 0)
+                goto error;
+        }
+        for (j=0; j < nguard; j++) {
+            PyFuncGuardObject *guard = (PyFuncGuardObject *)guard_array[j];
+            if (guard->check((PyObject *)guard, stack, nargs, NULL) < 0)
+                goto error;
+        }
+    }
+    t2 = _PyTime_GetMonotonicClock();
+
+    if (dict != NULL && PyDict_DelItem(dict, key) < 0)
+        goto error;
+    Py_XDECREF(key);
+
+    dt = _PyTime_AsSecondsDouble((t2 - t1) - (t1 - t0));
+    return PyFloat_FromDouble(dt / number);
+
+error:
+    Py_XDECREF(key);
+    return NULL;
+}
+
+PyDoc_STRVAR(bench_check_doc,
+"_bench_check(guards, number, args=(), dict=None, mutate_every=1) -> float\n"
+"\n"
+"Call the check function of guards number times with args and return the\n"
+"average duration of an iteration in seconds. guards is a guard or a\n"
+"tuple of guards. If dict is set, modify one of its keys every\n"
+"mutate_every iterations to change its version.");
+
 static struct PyMethodDef fat_methods[] = {
     {"specialize", (PyCFunction)fat_specialize, METH_VARARGS,
      specialize_doc},
+    {"specialize_many", (PyCFunction)fat_specialize_many,
+     METH_VARARGS | METH_KEYWORDS, specialize_many_doc},
     {"get_specialized", (PyCFunction)fat_get_specialized, METH_VARARGS,
      get_specialized_doc},
-    {"replace_consts", (PyCFunction)fat_replace_consts, METH_VARARGS,
-     patch_constants_doc},
+    {"replace_consts", (PyCFunction)fat_replace_consts,
+     METH_VARARGS | METH_KEYWORDS, patch_constants_doc},
+    {"replace_consts_cached", (PyCFunction)fat_replace_consts_cached,
+     METH_VARARGS | METH_KEYWORDS, replace_consts_cached_doc},
+    {"clear_code_cache", (PyCFunction)fat_clear_code_cache, METH_NOARGS,
+     clear_code_cache_doc},
     {"guard_type_dict", (PyCFunction)fat_guard_type_dict, METH_VARARGS,
      guard_type_dict_doc},
+    {"guard_globals_cached", (PyCFunction)fat_guard_globals_cached,
+     METH_VARARGS, guard_globals_cached_doc},
+    {"guard_builtins_cached", (PyCFunction)fat_guard_builtins_cached,
+     METH_VARARGS, guard_builtins_cached_doc},
+    {"clear_guard_cache", (PyCFunction)fat_clear_guard_cache, METH_NOARGS,
+     clear_guard_cache_doc},
+    {"stats", (PyCFunction)fat_stats, METH_NOARGS, stats_doc},
+    {"get_max_fails", (PyCFunction)fat_get_max_fails, METH_NOARGS,
+     get_max_fails_doc},
+    {"set_max_fails", (PyCFunction)fat_set_max_fails, METH_VARARGS,
+     set_max_fails_doc},
+    {"_bench_check", (PyCFunction)fat_bench_check, METH_VARARGS,
+     bench_check_doc},
     {NULL, NULL}                /* sentinel */
 };
 
@@ -1205,7 +5774,7 @@ fat_init_builtins(void)
     PyThreadState* tstate;
     PyObject *builtins;
 
-    if (init_builtins != NULL)
+    if (init_builtins_snapshot != NULL)
         /* already initialized */
         return 0;
 
@@ -1223,10 +5792,10 @@ fat_init_builtins(void)
         return -1;
     }
 
-    init_builtins = PyDict_Copy(builtins);
-    if (init_builtins == NULL)
+    /* copy the whole dict: names guarded later are unknown */
+    init_builtins_snapshot = PyDict_Copy(builtins);
+    if (init_builtins_snapshot == NULL)
         return -1;
-
     return 0;
 }
 
@@ -1238,6 +5807,9 @@ PyInit_fat(void)
     if (fat_init_builtins() < 0)
         return NULL;
 
+    if (fat_init_dict_entries() < 0)
+        return NULL;
+
     mod = PyModule_Create(&fatmodule);
     if (mod == NULL)
         return NULL;
@@ -1245,9 +5817,27 @@ PyInit_fat(void)
     if (PyType_Ready(&GuardFunc_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardCell_Type) < 0)
+        return NULL;
+
     if (PyType_Ready(&GuardArgType_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardArgTypes_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardArgValue_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardArgIntRange_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardType_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardInstanceShape_Type) < 0)
+        return NULL;
+
     if (PyType_Ready(&GuardDict_Type) < 0)
         return NULL;
 
@@ -1257,6 +5847,9 @@ PyInit_fat(void)
     if (PyType_Ready(&GuardBuiltins_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardModuleAttr_Type) < 0)
+        return NULL;
+
     value = PyUnicode_FromString(VERSION);
     if (value == NULL)
         return NULL;
@@ -1273,11 +5866,41 @@ PyInit_fat(void)
                            (PyObject *)&GuardFunc_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardCell_Type);
+    if (PyModule_AddObject(mod, "GuardCell",
+                           (PyObject *)&GuardCell_Type) < 0)
+        return NULL;
+
     Py_INCREF(&GuardArgType_Type);
     if (PyModule_AddObject(mod, "GuardArgType",
                            (PyObject *)&GuardArgType_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardArgTypes_Type);
+    if (PyModule_AddObject(mod, "GuardArgTypes",
+                           (PyObject *)&GuardArgTypes_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardArgValue_Type);
+    if (PyModule_AddObject(mod, "GuardArgValue",
+                           (PyObject *)&GuardArgValue_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardArgIntRange_Type);
+    if (PyModule_AddObject(mod, "GuardArgIntRange",
+                           (PyObject *)&GuardArgIntRange_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardType_Type);
+    if (PyModule_AddObject(mod, "GuardType",
+                           (PyObject *)&GuardType_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardInstanceShape_Type);
+    if (PyModule_AddObject(mod, "GuardInstanceShape",
+                           (PyObject *)&GuardInstanceShape_Type) < 0)
+        return NULL;
+
     Py_INCREF(&GuardDict_Type);
     if (PyModule_AddObject(mod, "GuardDict",
                            (PyObject *)&GuardDict_Type) < 0)
@@ -1293,5 +5916,10 @@ PyInit_fat(void)
                            (PyObject *)&GuardBuiltins_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardModuleAttr_Type);
+    if (PyModule_AddObject(mod, "GuardModuleAttr",
+                           (PyObject *)&GuardModuleAttr_Type) < 0)
+        return NULL;
+
     return mod;
 }
@@ -32,6 +32,9 @@ import sys
 # Debug pytracemalloc
 DEBUG = False
 
+# Count guard checks (fat.stats() and guard.stats)
+STATS = True
+
 VERSION = '0.3'
 
 CLASSIFIERS = [
@@ -56,6 +59,8 @@ def main():
     cflags = []
     if not DEBUG:
         cflags.append('-DNDEBUG')
+    if not STATS:
+        cflags.append('-DFAT_NO_STATS')
 
     with open('README.rst') as f:
         long_description = f.read().strip()
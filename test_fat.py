@@ -2,11 +2,15 @@
 __fatoptimizer__ = {'enabled': False}
 
 import builtins
+import dis
 import fat
 import os.path
+import subprocess
 import sys
 import textwrap
+import types
 import unittest
+import weakref
 
 
 class GuardsTests(unittest.TestCase):
@@ -24,9 +28,274 @@ class GuardsTests(unittest.TestCase):
         self.assertEqual(guard(1, 2, 3), 0)
         self.assertEqual(guard(1, 2, "hello"), 1)
 
-        # FIXME: keywords are not supported yet
+        # the parameter name is unknown until the guard is used to
+        # specialize a function
+        self.assertIsNone(guard.arg_name)
         self.assertEqual(guard(1, 2, arg=3), 1)
 
+    def test_guard_arg_type_many_types(self):
+        classes = [type('Class%s' % i, (), {}) for i in range(20)]
+        types = (int, float, bool, str, bytes, int) + tuple(classes)
+        guard = fat.GuardArgType(0, types)
+        self.assertEqual(guard.arg_types, types)
+
+        for arg in (1, 2.0, True, "abc", b"abc", classes[0](), classes[-1]()):
+            self.assertEqual(guard(arg), 0)
+        for arg in (None, [], 1j, type('Other', (), {})()):
+            self.assertEqual(guard(arg), 1)
+
+    def test_guard_arg_type_keyword(self):
+        guard = fat.GuardArgType(2, (int,), arg_name='arg')
+        self.assertEqual(guard.arg_name, 'arg')
+
+        self.assertEqual(guard(1, 2, 3), 0)
+        self.assertEqual(guard(1, 2, arg=3), 0)
+        self.assertEqual(guard(1, 2, arg="hello"), 1)
+        self.assertEqual(guard(1, 2, other=3), 1)
+        self.assertEqual(guard(1, 2, other=3, arg=4), 0)
+        self.assertEqual(guard(1, 2), 1)
+
+    def test_guard_arg_type_subclasses(self):
+        class MyStr(str):
+            pass
+
+        class MyInt(int):
+            pass
+
+        guard = fat.GuardArgType(0, (str, int), subclasses=True)
+        self.assertTrue(guard.subclasses)
+        self.assertFalse(fat.GuardArgType(0, (str,)).subclasses)
+
+        for arg in ("abc", 1, True, MyStr("abc"), MyInt(1)):
+            # twice: the result is cached
+            for i in range(2):
+                self.assertEqual(guard(arg), 0, arg)
+        for arg in (1.0, b"abc", None):
+            for i in range(2):
+                self.assertEqual(guard(arg), 1, arg)
+
+        # more types than cache entries
+        classes = [type('Class%s' % i, (int,), {}) for i in range(10)]
+        for cls in classes * 2:
+            self.assertEqual(guard(cls()), 0)
+
+        # modify the bases of a type
+        class A:
+            pass
+
+        class B:
+            pass
+
+        class Sub(A):
+            pass
+
+        guard = fat.GuardArgType(0, (A,), subclasses=True)
+        self.assertEqual(guard(Sub()), 0)
+        Sub.__bases__ = (B,)
+        self.assertEqual(guard(Sub()), 1)
+        Sub.__bases__ = (A,)
+        self.assertEqual(guard(Sub()), 0)
+
+    def test_guard_arg_types(self):
+        guard = fat.GuardArgTypes([(0, (int, float)), (2, [str])])
+        self.assertEqual(guard.arg_types, ((0, (int, float)), (2, (str,))))
+
+        self.assertEqual(guard(1, None, "abc"), 0)
+        self.assertEqual(guard(1.0, None, "abc"), 0)
+        self.assertEqual(guard("x", None, "abc"), 1)
+        self.assertEqual(guard(1, None, b"abc"), 1)
+        self.assertEqual(guard(1, None), 1)
+
+    def test_guard_arg_value(self):
+        guard = fat.GuardArgValue(1, (None, False, 0, 'strict', ...))
+        self.assertEqual(guard.arg_index, 1)
+        self.assertEqual(guard.values, (None, False, 0, 'strict', ...))
+        self.assertIsNone(guard.arg_name)
+
+        for value in (None, False, 0, 'strict', ...):
+            self.assertEqual(guard('x', value), 0)
+        for value in (True, 1, 0.0, 'replace', []):
+            self.assertEqual(guard('x', value), 1)
+        self.assertEqual(guard('x'), 1)
+        self.assertEqual(guard('x', errors=None), 1)
+
+        # small ints are cached
+        guard = fat.GuardArgValue(0, [int('256'), -5])
+        self.assertEqual(guard(256), 0)
+        self.assertEqual(guard(-5), 0)
+
+        # a str which is not interned is compared by value
+        guard = fat.GuardArgValue(0, ['utf-8'])
+        self.assertEqual(guard(sys.intern('utf-8')), 0)
+        self.assertEqual(guard(''.join(('utf', '-8'))), 0)
+        self.assertEqual(guard(''.join(('utf', '-16'))), 1)
+        self.assertEqual(guard(b'utf-8'), 1)
+
+        for value in (257, -6, 1.0, (), b'bytes'):
+            self.assertRaises(TypeError, fat.GuardArgValue, 0, (value,))
+        self.assertRaises(ValueError, fat.GuardArgValue, 0, ())
+        self.assertRaises(ValueError, fat.GuardArgValue, -1, (None,))
+
+    def test_guard_arg_int_range(self):
+        guard = fat.GuardArgIntRange(0, -2 ** 31, 2 ** 31 - 1)
+        self.assertEqual(guard.arg_index, 0)
+        self.assertEqual(guard.min, -2 ** 31)
+        self.assertEqual(guard.max, 2 ** 31 - 1)
+
+        for arg in (0, 1, -1, 2 ** 30, 2 ** 31 - 1, -2 ** 31):
+            self.assertEqual(guard(arg), 0, arg)
+        for arg in (2 ** 31, -2 ** 31 - 1, 2 ** 100, -2 ** 100,
+                    1.0, True, "1", None):
+            self.assertEqual(guard(arg), 1, arg)
+        self.assertEqual(guard(), 1)
+
+        # bounds close to the limits of a C long long
+        guard = fat.GuardArgIntRange(1, 2 ** 62 + 1, 2 ** 63 - 1)
+        for arg in (2 ** 62 + 1, 2 ** 63 - 1):
+            self.assertEqual(guard(None, arg), 0, arg)
+        for arg in (2 ** 62, 2 ** 63, 2 ** 64, 5, -2 ** 63):
+            self.assertEqual(guard(None, arg), 1, arg)
+
+        guard = fat.GuardArgIntRange(0, -2 ** 63, -2 ** 62)
+        self.assertEqual(guard(-2 ** 63), 0)
+        self.assertEqual(guard(-2 ** 62), 0)
+        self.assertEqual(guard(-2 ** 62 + 1), 1)
+        self.assertEqual(guard(-2 ** 63 - 1), 1)
+
+        self.assertRaises(ValueError, fat.GuardArgIntRange, 0, 1, 0)
+        self.assertRaises(ValueError, fat.GuardArgIntRange, -1, 0, 1)
+        self.assertRaises(OverflowError, fat.GuardArgIntRange, 0, 0, 2 ** 63)
+        self.assertRaises(TypeError, fat.GuardArgIntRange, 0, 0.0, 1)
+
+    def test_guard_type(self):
+        class Base:
+            def meth(self):
+                pass
+
+        class MyClass(Base):
+            pass
+
+        guard = fat.GuardType(MyClass, 'meth', 'missing')
+        self.assertIs(guard.type, MyClass)
+        self.assertEqual(guard.keys, ('meth', 'missing'))
+        self.assertEqual(guard(), 0)
+
+        # unrelated attributes
+        MyClass.attr = 1
+        self.assertEqual(guard(), 0)
+        Base.attr = 2
+        self.assertEqual(guard(), 0)
+
+        # attribute set to the same value
+        MyClass.meth = Base.meth
+        self.assertEqual(guard(), 0)
+        del MyClass.meth
+        self.assertEqual(guard(), 0)
+
+        # attribute of a base class
+        Base.meth = lambda self: None
+        self.assertEqual(guard(), 2)
+
+        guard = fat.GuardType(MyClass, 'missing')
+        MyClass.missing = 1
+        self.assertEqual(guard(), 2)
+
+        # change the bases of the type
+        class Base2:
+            def meth(self):
+                pass
+
+        guard = fat.GuardType(MyClass, 'meth')
+        MyClass.__bases__ = (Base2,)
+        self.assertEqual(guard(), 2)
+
+        self.assertRaises(TypeError, fat.GuardType, MyClass)
+        self.assertRaises(TypeError, fat.GuardType, 1, 'meth')
+        self.assertRaises(TypeError, fat.GuardType, MyClass, 1)
+
+    def test_guard_type_dict(self):
+        class MyClass:
+            def meth(self):
+                pass
+
+        guard = fat.guard_type_dict(MyClass, 'meth')
+        self.assertIsInstance(guard, fat.GuardType)
+        self.assertEqual(guard.keys, ('meth',))
+
+        guard = fat.guard_type_dict(MyClass, ['meth', 'attr'])
+        self.assertEqual(guard.keys, ('meth', 'attr'))
+        self.assertEqual(guard(), 0)
+        MyClass.attr = 1
+        self.assertEqual(guard(), 2)
+
+    def test_guard_instance_shape(self):
+        class Point:
+            def __init__(self, x, y):
+                self.x = x
+                self.y = y
+
+        guard = fat.GuardInstanceShape(Point)
+        self.assertIs(guard.type, Point)
+        self.assertEqual(guard.arg_index, 0)
+
+        point = Point(1, 2)
+        self.assertEqual(guard(point), 0)
+        self.assertEqual(guard(self=point), 1)
+        self.assertEqual(guard(object()), 1)
+        self.assertEqual(guard(), 1)
+
+        # no instance dict yet
+        self.assertEqual(guard(Point.__new__(Point)), 1)
+
+        # attributes set in a different order: the instance dict doesn't
+        # share keys anymore, neither do new instances
+        point2 = Point.__new__(Point)
+        point2.y = 2
+        point2.x = 1
+        self.assertEqual(guard(point2), 2)
+        self.assertEqual(guard(point), 0)
+
+        # the type doesn't share keys anymore
+        self.assertRaises(ValueError, fat.GuardInstanceShape, Point)
+
+        # the guard doesn't prevent the type from rebuilding its shared
+        # keys when no instance uses them anymore
+        class Point:
+            def __init__(self, x, y):
+                self.x = x
+                self.y = y
+
+        point = Point(1, 2)
+        guard = fat.GuardInstanceShape(Point)
+        self.assertEqual(guard(point), 0)
+        del point
+        point2 = Point.__new__(Point)
+        point2.y = 2
+        point2.x = 1
+        self.assertEqual(guard(point2), 2)
+        guard2 = fat.GuardInstanceShape(Point)
+        self.assertEqual(guard2(point2), 0)
+
+        # modify the type
+        class Point:
+            def __init__(self, x, y):
+                self.x = x
+                self.y = y
+
+        point = Point(1, 2)
+        guard = fat.GuardInstanceShape(Point, arg_index=1)
+        self.assertEqual(guard(None, point), 0)
+        Point.z = 3
+        self.assertEqual(guard(None, point), 2)
+
+        # instances without dict
+        guard = fat.GuardInstanceShape(int)
+        self.assertEqual(guard(1), 0)
+        self.assertEqual(guard(True), 1)
+
+        self.assertRaises(TypeError, fat.GuardInstanceShape, point)
+        self.assertRaises(ValueError, fat.GuardInstanceShape, Point, -1)
+
     def test_guard_dict(self):
         ns = {'key': 1}
 
@@ -39,6 +308,198 @@ class GuardsTests(unittest.TestCase):
         ns['key'] = 2
         self.assertEqual(guard(), 2)
 
+    def test_guard_dict_missing_key(self):
+        ns = {}
+        guard = fat.GuardDict(ns, 'key')
+
+        # another key was modified
+        ns['other'] = 1
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 2
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_resize(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+
+        # resize the dict: the dict entry of the watched key moves
+        for i in range(100):
+            ns['x%s' % i] = i
+        self.assertEqual(guard(), 0)
+        for i in range(100):
+            del ns['x%s' % i]
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 2
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_deleted_key(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+
+        del ns['key']
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_split_table(self):
+        class MyClass:
+            pass
+
+        obj1 = MyClass()
+        obj1.key = 1
+        obj2 = MyClass()
+        obj2.key = 2
+
+        # instance dicts share their keys
+        ns = obj1.__dict__
+        guard = fat.GuardDict(ns, 'key')
+
+        obj2.key = 3
+        obj1.other = 4
+        self.assertEqual(guard(), 0)
+
+        obj1.key = 5
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_many_keys(self):
+        keys = ['key%s' % i for i in range(5)]
+        ns = {key: i for i, key in enumerate(keys)}
+
+        guard1 = fat.GuardDict(ns, 'key0')
+        guard3 = fat.GuardDict(ns, *keys[:3])
+        guard5 = fat.GuardDict(ns, *keys)
+        self.assertEqual(guard5.keys, tuple(keys))
+
+        # pairs are stored inline, the guard size depends on the number
+        # of keys
+        self.assertGreater(sys.getsizeof(guard3), sys.getsizeof(guard1))
+        self.assertGreater(sys.getsizeof(guard5), sys.getsizeof(guard3))
+
+        self.assertEqual(guard5(), 0)
+        ns['key4'] = 'new'
+        self.assertEqual(guard5(), 2)
+
+        # initialize again the guard with more keys, and then less keys
+        size = sys.getsizeof(guard1)
+        guard1.__init__(ns, *keys[:4])
+        self.assertEqual(guard1.keys, tuple(keys[:4]))
+        self.assertGreater(sys.getsizeof(guard1), size)
+        guard1.__init__(ns, 'key1')
+        self.assertEqual(guard1.keys, ('key1',))
+        self.assertEqual(guard1(), 0)
+        ns['key1'] = 'new'
+        self.assertEqual(guard1(), 2)
+
+    def test_guard_dict_shared(self):
+        # guards watching the same dict share the check of their keys
+        ns = {'key1': 1, 'key2': 2}
+        guard1 = fat.GuardDict(ns, 'key1')
+        guard2 = fat.GuardDict(ns, 'key1', 'key2')
+        guard3 = fat.GuardDict(ns, 'key2')
+
+        ns['other'] = 3
+        self.assertEqual(guard1(), 0)
+        self.assertEqual(guard2(), 0)
+        self.assertEqual(guard3(), 0)
+
+        ns['key2'] = 4
+        guard4 = fat.GuardDict(ns, 'key2')
+        self.assertEqual(guard1(), 0)
+        self.assertEqual(guard2(), 2)
+        self.assertEqual(guard3(), 2)
+        self.assertEqual(guard4(), 0)
+
+        del guard2, guard3
+        ns['key1'] = 5
+        self.assertEqual(guard1(), 2)
+        self.assertEqual(guard4(), 0)
+
+        # slots of released pairs are reused
+        ns = {'key1': 1, 'key2': 2}
+        guard1 = fat.GuardDict(ns, 'key1')
+        for i in range(3):
+            guard2 = fat.GuardDict(ns, 'key2')
+            guard3 = fat.GuardDict(ns, 'key1', 'key2')
+            ns['key2'] = i
+            self.assertEqual(guard1(), 0)
+            self.assertEqual(guard2(), 2)
+            self.assertEqual(guard3(), 2)
+            del guard2, guard3
+        ns['key1'] = 0
+        self.assertEqual(guard1(), 2)
+
+    def test_guard_dict_subclass(self):
+        class Namespace(dict):
+            def __missing__(self, key):
+                return 'default'
+
+        ns = Namespace()
+        guard = fat.GuardDict(ns, 'key')
+
+        ns['other'] = 1
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 'value'
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_subclass_reentrant(self):
+        # __getitem__() creates guards on the same dict during the check:
+        # the pairs of the watcher are reallocated
+        class Namespace(dict):
+            def __getitem__(self, key):
+                if key == 'key1' and self.create:
+                    self.create = False
+                    guards.extend(fat.GuardDict(self, 'new%s' % i)
+                                  for i in range(100))
+                return dict.__getitem__(self, key)
+
+        guards = []
+        ns = Namespace(key1=1, key2=2)
+        ns.create = False
+        guard = fat.GuardDict(ns, 'key1', 'key2')
+        ns.create = True
+        ns['other'] = 3
+        self.assertEqual(guard(), 0)
+        self.assertEqual(len(guards), 100)
+        ns['key2'] = 4
+        self.assertEqual(guard(), 2)
+        self.assertEqual(guards[0](), 0)
+
+        # __getitem__() calls __init__() again: the watcher of the dict
+        # is released during the check
+        class Namespace(dict):
+            def __getitem__(self, key):
+                if self.reinit:
+                    self.reinit = False
+                    guard.__init__({'key': 1}, 'key')
+                return dict.__getitem__(self, key)
+
+        ns = Namespace(key1=1, key2=2)
+        ns.reinit = False
+        guard = fat.GuardDict(ns, 'key1', 'key2')
+        ns.reinit = True
+        ns['other'] = 3
+        self.assertEqual(guard(), 1)
+        self.assertEqual(guard(), 0)
+
+    def test_bench_check(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+        self.assertIsInstance(fat._bench_check(guard, 10, (), ns), float)
+        self.assertNotIn('__fat_bench__', ns)
+        self.assertEqual(guard(), 0)
+
+        guard = fat.GuardArgType(0, (int,))
+        self.assertIsInstance(fat._bench_check(guard, 10, (1,)), float)
+
+        self.assertRaises(TypeError, fat._bench_check, 'guard', 10)
+        self.assertRaises(ValueError, fat._bench_check, guard, 0)
+
+        # modify the dict every 3 checks
+        guard = fat.GuardDict(ns, 'key')
+        self.assertIsInstance(fat._bench_check(guard, 10, (), ns, 3), float)
+        self.assertRaises(ValueError, fat._bench_check, guard, 10, (), ns, 0)
+
     def test_globals(self):
         guard = fat.GuardGlobals('key')
         self.assertIs(guard.dict, globals())
@@ -70,9 +531,7 @@ class GuardsTests(unittest.TestCase):
         self.assertIs(guard.dict, builtins.__dict__)
         self.assertEqual(guard.keys, ('key',))
 
-        guard_globals = guard.guard_globals
-        self.assertIs(guard_globals.dict, globals())
-        self.assertEqual(guard_globals.keys, ('key',))
+        self.assertIs(guard.globals, globals())
 
         # not enough parameters
         self.assertRaises(TypeError, fat.GuardBuiltins)
@@ -116,6 +575,67 @@ class GuardsTests(unittest.TestCase):
         # global was replaced
         self.assertEqual(guard(), 2)
 
+    def test_builtins_modified(self):
+        global global_var
+
+        guard = fat.GuardBuiltins('global_var', 'len')
+        self.assertEqual(guard(), 0)
+
+        # unrelated changes
+        builtins.fat_test_unrelated = 1
+        try:
+            self.assertEqual(guard(), 0)
+        finally:
+            del builtins.fat_test_unrelated
+        self.assertEqual(guard(), 0)
+
+        # name defined in the global namespace
+        try:
+            global_var = "hello"
+            self.assertEqual(guard(), 2)
+        finally:
+            del global_var
+
+        # builtin replaced
+        guard = fat.GuardBuiltins('global_var', 'len')
+        old_len = builtins.len
+        builtins.len = lambda obj: 0
+        try:
+            self.assertEqual(guard(), 2)
+        finally:
+            builtins.len = old_len
+
+    def test_builtins_modified_before_first_guard(self):
+        # run in a new process: builtins are modified before the first
+        # GuardBuiltins of the process
+        code = textwrap.dedent("""
+            import builtins
+            import fat
+
+            builtins._ = 'last result'
+            builtins.chr = lambda obj: 'mock'
+
+            def func():
+                return len('abc')
+
+            def func2():
+                return chr(65)
+
+            def fast():
+                return 'fast'
+
+            fat.specialize(func, fast, [fat.GuardBuiltins('len')])
+            fat.specialize(func2, fast, [fat.GuardBuiltins('chr')])
+            print(len(fat.get_specialized(func)),
+                  len(fat.get_specialized(func2)))
+        """)
+        proc = subprocess.run([sys.executable, '-c', code],
+                              stdout=subprocess.PIPE,
+                              universal_newlines=True)
+        self.assertEqual(proc.returncode, 0)
+        # only the function using the modified builtin is not specialized
+        self.assertEqual(proc.stdout.split(), ['1', '0'])
+
     def test_builtins_replace_globals(self):
         guard = fat.GuardBuiltins('key')
         self.assertEqual(guard(), 0)
@@ -128,6 +648,187 @@ class GuardsTests(unittest.TestCase):
 
         self.assertEqual(check, 2)
 
+    def test_guard_bound(self):
+        def func():
+            pass
+
+        def fast():
+            pass
+
+        def create_guards():
+            return [fat.GuardGlobals('x'),
+                    fat.GuardBuiltins('len'),
+                    fat.GuardModuleAttr('os', 'path')]
+
+        # guards not used to specialize a function check the globals of
+        # the current frame
+        guards = create_guards()
+        ns = {'guards': guards}
+        exec("checks = [guard() for guard in guards]", ns)
+        self.assertEqual(ns['checks'], [2, 2, 2])
+
+        # bound to the globals of func by specialize()
+        guards = create_guards()
+        fat.specialize(func, fast, guards)
+        self.assertEqual(len(fat.get_specialized(func)), 1)
+        ns = {'guards': guards}
+        exec("checks = [guard() for guard in guards]", ns)
+        self.assertEqual(ns['checks'], [0, 0, 0])
+
+        # the function uses different globals: don't specialize
+        func2 = types.FunctionType(func.__code__, {'__builtins__': builtins})
+        for guard in create_guards():
+            fat.specialize(func2, fast, [guard])
+        self.assertEqual(fat.get_specialized(func2), [])
+
+        # __builtins__ of globals replaced
+        ns = {'__builtins__': dict(builtins.__dict__), 'fat': fat}
+        exec(textwrap.dedent("""
+            def func():
+                pass
+
+            def fast():
+                pass
+
+            guard = fat.GuardBuiltins('len')
+            fat.specialize(func, fast, [guard])
+        """), ns)
+        guard = ns['guard']
+        self.assertEqual(len(fat.get_specialized(ns['func'])), 1)
+        self.assertEqual(guard(), 0)
+        ns['__builtins__'] = dict(builtins.__dict__)
+        self.assertEqual(guard(), 2)
+
+    def test_guard_module_attr(self):
+        global fat_test_module
+
+        fat_test_module = types.ModuleType('fat_test_module')
+        fat_test_module.sub = types.ModuleType('sub')
+        fat_test_module.sub.func = len
+        try:
+            guard = fat.GuardModuleAttr('fat_test_module', 'sub.func')
+            self.assertEqual(guard.global_name, 'fat_test_module')
+            self.assertEqual(guard.attrs, ('sub', 'func'))
+            self.assertIs(guard.globals, globals())
+            self.assertEqual(guard(), 0)
+
+            # unrelated changes
+            fat_test_module.other = 1
+            fat_test_module.sub.other = 2
+            self.assertEqual(guard(), 0)
+
+            fat_test_module.sub.func = abs
+            self.assertEqual(guard(), 2)
+
+            # missing attribute
+            guard = fat.GuardModuleAttr('fat_test_module', ('sub', 'missing'))
+            self.assertEqual(guard(), 0)
+            fat_test_module.sub.missing = 1
+            self.assertEqual(guard(), 2)
+
+            # module replaced
+            guard = fat.GuardModuleAttr('fat_test_module', 'sub.func')
+            fat_test_module.sub = types.ModuleType('sub')
+            self.assertEqual(guard(), 2)
+
+            guard = fat.GuardModuleAttr('fat_test_module', 'sub')
+            fat_test_module = types.ModuleType('fat_test_module')
+            self.assertEqual(guard(), 2)
+        finally:
+            del fat_test_module
+
+        guard = fat.GuardModuleAttr('os', 'path.join')
+        self.assertEqual(guard(), 0)
+
+        # check the guard in a different global namespace
+        ns = {'guard': guard}
+        exec("check = guard()", ns)
+        self.assertEqual(ns['check'], 2)
+
+        # guards must be created in this global namespace
+        with self.assertRaises(NameError):
+            fat.GuardModuleAttr('unknown', 'attr')
+        with self.assertRaises(AttributeError):
+            fat.GuardModuleAttr('os', 'unknown.join')
+        with self.assertRaises(TypeError):
+            # os.sep is not a module
+            fat.GuardModuleAttr('os', 'sep.join')
+        with self.assertRaises(ValueError):
+            fat.GuardModuleAttr('os', '')
+        with self.assertRaises(ValueError):
+            fat.GuardModuleAttr('os', ())
+        with self.assertRaises(TypeError):
+            fat.GuardModuleAttr('os', ['path'])
+
+    def test_guard_cached(self):
+        fat.clear_guard_cache()
+
+        guard = fat.guard_builtins_cached('len', 'isinstance')
+        self.assertIsInstance(guard, fat.GuardBuiltins)
+        self.assertEqual(guard.keys, ('len', 'isinstance'))
+        self.assertIs(fat.guard_builtins_cached('len', 'isinstance'), guard)
+        self.assertIsNot(fat.guard_builtins_cached('len'), guard)
+
+        guard2 = fat.guard_globals_cached('len', 'isinstance')
+        self.assertIsInstance(guard2, fat.GuardGlobals)
+        self.assertIs(fat.guard_globals_cached('len', 'isinstance'), guard2)
+
+        # different globals
+        ns = {'fat': fat}
+        exec("guard = fat.guard_builtins_cached('len', 'isinstance')", ns)
+        self.assertIsNot(ns['guard'], guard)
+        self.assertIs(ns['guard'].globals, ns)
+
+        fat.clear_guard_cache()
+        self.assertIsNot(fat.guard_builtins_cached('len', 'isinstance'),
+                         guard)
+
+        # a guard which fails is replaced
+        ns = {'fat': fat, 'key': 1}
+        code = "guard = fat.guard_globals_cached('key')"
+        exec(code, ns)
+        guard = ns['guard']
+        exec(code, ns)
+        self.assertIs(ns['guard'], guard)
+        ns['key'] = 2
+        exec(code, ns)
+        self.assertIsNot(ns['guard'], guard)
+        guard = ns['guard']
+        exec(code, ns)
+        self.assertIs(ns['guard'], guard)
+        # the value of the first guard is restored
+        ns['key'] = 1
+        exec(code, ns)
+        self.assertIsNot(ns['guard'], guard)
+
+        # the cache doesn't keep guards alive, nor their globals
+        ns = {'fat': fat}
+        refcnt = sys.getrefcount(ns)
+        exec("for i in range(1000): fat.guard_globals_cached('k%s' % i)", ns)
+        self.assertEqual(sys.getrefcount(ns), refcnt)
+        exec("guard = fat.guard_globals_cached('key')", ns)
+        guard_ref = weakref.ref(ns.pop('guard'))
+        self.assertIsNone(guard_ref())
+
+        # a guard only kept alive by a reference cycle stays cached
+        class Holder:
+            pass
+
+        ns = {'fat': fat}
+        code = "guard = fat.guard_globals_cached('key')"
+        exec(code, ns)
+        holder = Holder()
+        holder.holder = holder
+        holder.guard = ns.pop('guard')
+        exec("for i in range(1000): fat.guard_globals_cached('k%s' % i)", ns)
+        exec(code, ns)
+        self.assertIs(ns['guard'], holder.guard)
+        del holder
+
+        self.assertRaises(TypeError, fat.guard_builtins_cached, 123)
+        self.assertRaises(TypeError, fat.guard_globals_cached)
+        fat.clear_guard_cache()
+
     def test_guard_func(self):
         def func():
             return 3
@@ -144,6 +845,157 @@ class GuardsTests(unittest.TestCase):
         func.__code__ = func2.__code__
         self.assertEqual(guard(), 2)
 
+    def test_guard_cell(self):
+        def create():
+            helper = len
+            unset = 1
+            del unset
+
+            def func(seq):
+                return helper(seq) + unset
+
+            def set_helper(value):
+                nonlocal helper
+                helper = value
+
+            def set_unset(value):
+                nonlocal unset
+                unset = value
+
+            return func, set_helper, set_unset
+
+        func, set_helper, set_unset = create()
+        guard = fat.GuardCell(func, 'helper')
+        self.assertIs(guard.func, func)
+        self.assertEqual(guard.freevar_name, 'helper')
+        self.assertIs(guard.cell, func.__closure__[0])
+        self.assertEqual(guard(), 0)
+
+        set_helper(len)
+        self.assertEqual(guard(), 0)
+        set_helper(abs)
+        self.assertEqual(guard(), 2)
+
+        # empty cell
+        guard = fat.GuardCell(func, 'unset')
+        self.assertEqual(guard(), 0)
+        set_unset(1)
+        self.assertEqual(guard(), 2)
+
+        self.assertRaises(ValueError, fat.GuardCell, func, 'seq')
+        self.assertRaises(ValueError, fat.GuardCell, func, 'unknown')
+        self.assertRaises(TypeError, fat.GuardCell, len, 'helper')
+
+        # the guard only watches the cell of functions sharing it
+        func, set_helper, set_unset = create()
+        func2, set_helper2, set_unset2 = create()
+        guard = fat.GuardCell(func, 'helper')
+
+        def fast(seq):
+            return 0
+
+        fat.specialize(func2, fast, [guard])
+        self.assertEqual(fat.get_specialized(func2), [])
+        fat.specialize(func, fast, [guard])
+        self.assertEqual(len(fat.get_specialized(func)), 1)
+
+    def test_stats(self):
+        stats = fat.stats()
+        if stats is None:
+            self.skipTest("statistics are disabled")
+        self.assertEqual(set(stats),
+                         {'GuardArgType', 'GuardArgTypes', 'GuardArgValue',
+                          'GuardArgIntRange', 'GuardFunc', 'GuardCell',
+                          'GuardType', 'GuardInstanceShape', 'GuardDict',
+                          'GuardGlobals', 'GuardBuiltins',
+                          'GuardModuleAttr'})
+
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(guard.stats,
+                         {'hit': 0, 'miss': 0, 'invalidate': 0})
+        guard(1)
+        guard("abc")
+        guard("abc")
+        self.assertEqual(guard.stats,
+                         {'hit': 1, 'miss': 2, 'invalidate': 0})
+
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+        guard()
+        ns['key'] = 2
+        guard()
+        self.assertEqual(guard.stats,
+                         {'hit': 1, 'miss': 0, 'invalidate': 1})
+
+        stats2 = fat.stats()
+        for name, hit, miss, invalidate in (
+            ('GuardArgType', 1, 2, 0),
+            ('GuardDict', 1, 0, 1),
+            ('GuardGlobals', 0, 0, 0),
+        ):
+            before = stats[name]
+            after = stats2[name]
+            self.assertEqual(after['hit'] - before['hit'], hit, name)
+            self.assertEqual(after['miss'] - before['miss'], miss, name)
+            self.assertEqual(after['invalidate'] - before['invalidate'],
+                             invalidate, name)
+
+    def test_max_fails(self):
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(guard.max_fails, 0)
+
+        # no limit by default
+        for i in range(10):
+            self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard(1), 0)
+
+        guard.max_fails = 3
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 1)
+        # a success resets the number of consecutive failures
+        self.assertEqual(guard(1), 0)
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 1)
+        # give up after 3 failures
+        self.assertEqual(guard("abc"), 2)
+        self.assertEqual(guard(1), 2)
+
+        # failures are not counted without limit
+        guard = fat.GuardArgType(0, (int,))
+        for i in range(10):
+            self.assertEqual(guard("abc"), 1)
+        guard.max_fails = 2
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 2)
+
+        # changing the limit resets the number of failures
+        guard = fat.GuardArgType(0, (int,))
+        guard.max_fails = 3
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 1)
+        guard.max_fails = 3
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 1)
+
+        with self.assertRaises(ValueError):
+            guard.max_fails = -1
+
+    def test_default_max_fails(self):
+        old_max_fails = fat.get_max_fails()
+        self.addCleanup(fat.set_max_fails, old_max_fails)
+
+        fat.set_max_fails(2)
+        self.assertEqual(fat.get_max_fails(), 2)
+
+        guard = fat.GuardGlobals('key')
+        self.assertEqual(guard.max_fails, 2)
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(guard.max_fails, 2)
+        self.assertEqual(guard("abc"), 1)
+        self.assertEqual(guard("abc"), 2)
+
+        self.assertRaises(ValueError, fat.set_max_fails, -1)
+
 
 def guard_dict(ns, key):
     return [fat.GuardDict(ns, key)]
@@ -169,10 +1021,24 @@ class BaseTests(BaseTestCase):
 
         if guard_type == fat.GuardArgType:
             attrs = ('arg_index', 'arg_types')
+        elif guard_type == fat.GuardArgTypes:
+            attrs = ('arg_types',)
+        elif guard_type == fat.GuardArgValue:
+            attrs = ('arg_index', 'values')
+        elif guard_type == fat.GuardArgIntRange:
+            attrs = ('arg_index', 'min', 'max')
         elif guard_type in (fat.GuardDict, fat.GuardBuiltins):
             attrs = ('dict', 'keys')
         elif guard_type == fat.GuardFunc:
             attrs = ('func', 'code')
+        elif guard_type == fat.GuardCell:
+            attrs = ('func', 'freevar_name', 'cell')
+        elif guard_type == fat.GuardType:
+            attrs = ('type', 'keys')
+        elif guard_type == fat.GuardInstanceShape:
+            attrs = ('type', 'arg_index')
+        elif guard_type == fat.GuardModuleAttr:
+            attrs = ('global_name', 'attrs')
         else:
             raise NotImplementedError("unknown guard type")
 
@@ -489,6 +1355,39 @@ class BehaviourTests(BaseTestCase):
         self.assertEqual(func(obj), 'fast')
         self.assertEqual(func("test"), 'slow')
 
+    def test_arg_types(self):
+        def func(x, y, z=None):
+            return "slow"
+
+        def fast(x, y, z=None):
+            return "fast"
+
+        self.assertNotSpecialized(func)
+        self.assertNotSpecialized(fast)
+
+        guard = fat.GuardArgTypes([(0, (int,)), (1, (float,)), (2, (str,))])
+        fat.specialize(func, fast, [guard])
+
+        self.assertEqual(func(1, 2.0, z="abc"), 'fast')
+        self.assertEqual(func(1, y=2.0, z="abc"), 'fast')
+        self.assertEqual(func(1, 2.0), 'slow')
+        self.assertEqual(func(1, 2, z="abc"), 'slow')
+
+        # the index 1 is the first item of *args, not the keyword-only
+        # parameter k
+        def func(a, *args, k):
+            return "slow"
+
+        def fast(a, *args, k):
+            return "fast"
+
+        guard = fat.GuardArgTypes([(0, (int,)), (1, (str,))])
+        fat.specialize(func, fast, [guard])
+
+        self.assertEqual(func(1, "abc", k=2), 'fast')
+        self.assertEqual(func(1, 2, k="abc"), 'slow')
+        self.assertEqual(func(1, k="abc"), 'slow')
+
     def test_arg_type(self):
         def func(x):
             return "slow: %s" % x
@@ -503,8 +1402,7 @@ class BehaviourTests(BaseTestCase):
 
         self.assertEqual(func(3), 'fast: 3')
 
-        # FIXME: implement keywords
-        #self.assertEqual(func(x=4), 'fast: 4')
+        self.assertEqual(func(x=4), 'fast: 4')
 
         # calling with the wrong number of parameter must not disable the
         # optimization
@@ -520,6 +1418,44 @@ class BehaviourTests(BaseTestCase):
         # optimization must not be disabled after call with wrong types
         self.assertEqual(func(7), 'fast: 7')
 
+    def test_arg_value(self):
+        def func(x, flag=False):
+            if flag:
+                return "slow: flag %s" % x
+            return "slow: %s" % x
+
+        def fast(x, flag=False):
+            return "fast: %s" % x
+
+        fat.specialize(func, fast, [fat.GuardArgValue(1, (False,))])
+
+        self.assertEqual(func(1, False), 'fast: 1')
+        self.assertEqual(func(2, flag=False), 'fast: 2')
+        self.assertEqual(func(3, True), 'slow: flag 3')
+        # the default value is checked
+        self.assertEqual(func(4), 'fast: 4')
+        self.assertEqual(func(5, **{''.join(('fl', 'ag')): True}),
+                         'slow: flag 5')
+        func.__defaults__ = (True,)
+        self.assertEqual(func(6), 'slow: flag 6')
+        func.__defaults__ = None
+        with self.assertRaises(TypeError):
+            func(7)
+        func.__defaults__ = (False,)
+
+        # str literal which is not an identifier, so not interned
+        def func(data, encoding='utf-8'):
+            return "slow"
+
+        def fast(data, encoding='utf-8'):
+            return "fast"
+
+        fat.specialize(func, fast, [fat.GuardArgValue(1, ('utf-8',))])
+        self.assertEqual(func(b'abc', 'utf-8'), 'fast')
+        self.assertEqual(func(b'abc', encoding='utf-8'), 'fast')
+        self.assertEqual(func(b'abc'), 'fast')
+        self.assertEqual(func(b'abc', 'latin1'), 'slow')
+
     def test_builtin_guard_builtin_replaced(self):
         code = textwrap.dedent("""
             import fat
@@ -546,6 +1482,38 @@ class BehaviourTests(BaseTestCase):
         # guard init failed: it must always fail
         self.assertEqual(guard(), 2)
 
+    def test_builtin_guard_builtin_replaced_other(self):
+        code = textwrap.dedent("""
+            import fat
+
+            __builtins__['mock'] = lambda obj: "mock"
+            __builtins__['ord'] = chr
+
+            def func():
+                return chr(65)
+
+            def fast():
+                return "fast: A"
+
+            guard = fat.GuardBuiltins('chr')
+            fat.specialize(func, fast, [guard])
+
+            def func2():
+                return ord("A")
+
+            guard2 = fat.GuardBuiltins('ord')
+            fat.specialize(func2, fast, [guard2])
+        """)
+
+        ns = self._exec(code)
+
+        # builtins were modified, but chr() is unchanged
+        self.assertEqual(len(fat.get_specialized(ns['func'])), 1)
+
+        # ord() was replaced with another builtin function
+        self.assertEqual(len(fat.get_specialized(ns['func2'])), 0)
+        self.assertEqual(ns['guard2'](), 2)
+
     def test_builtin_guard_global_exists(self):
         code = textwrap.dedent("""
             import fat
@@ -627,6 +1595,30 @@ class MethodTests(BaseTestCase):
         del obj.meth
         self.assertEqual(obj.meth(), 'fast')
 
+    def test_instance_shape(self):
+        class Point:
+            def __init__(self, x, y):
+                self.x = x
+                self.y = y
+
+            def norm(self):
+                return 'slow'
+
+            def _fast(self):
+                return 'fast'
+
+        fat.specialize(Point.norm, Point._fast,
+                       [fat.GuardInstanceShape(Point)])
+
+        point = Point(1, 2)
+        self.assertEqual(point.norm(), 'fast')
+
+        del point.y
+        self.assertEqual(point.norm(), 'slow')
+
+        Point.attr = 1
+        self.assertEqual(Point(1, 2).norm(), 'slow')
+
 
 class SpecializeTests(BaseTests):
     """Test func.specialize() function."""
@@ -685,6 +1677,69 @@ class SpecializeTests(BaseTests):
         self.assertEqual(str(cm.exception),
                          "a function cannot specialize itself")
 
+    def test_specialize_many(self):
+        def func1():
+            return 'slow1'
+
+        def func2():
+            return 'slow2'
+
+        def fast():
+            return 'fast'
+
+        ns = {'key': 1}
+        results = fat.specialize_many([
+            (func1, fast, [fat.GuardDict(ns, 'key')]),
+            ('func', fast, []),
+            (func2, fast.__code__, [fat.GuardDict(ns, 'key')]),
+            (func1, fast, 'guard'),
+            'entry',
+        ], share_guards=True)
+
+        self.assertEqual(len(results), 5)
+        self.assertIsNone(results[0])
+        self.assertIsInstance(results[1], TypeError)
+        self.assertIsNone(results[2])
+        self.assertIsInstance(results[3], TypeError)
+        self.assertIsInstance(results[4], TypeError)
+
+        # guards watching the same keys of the same dict are shared
+        guards1 = fat.get_specialized(func1)[0][1]
+        guards2 = fat.get_specialized(func2)[0][1]
+        self.assertIs(guards1[0], guards2[0])
+
+        # guards created with different values are not shared
+        def func3():
+            return 'slow3'
+
+        def func4():
+            return 'slow4'
+
+        guard3 = fat.GuardDict(ns, 'key')
+        ns['key'] = 2
+        guard4 = fat.GuardDict(ns, 'key')
+        fat.specialize_many([(func3, fast, [guard3]),
+                             (func4, fast, [guard4])], share_guards=True)
+        self.assertIs(fat.get_specialized(func3)[0][1][0], guard3)
+        self.assertIs(fat.get_specialized(func4)[0][1][0], guard4)
+
+        # guards are not shared by default
+        def func5():
+            return 'slow5'
+
+        def func6():
+            return 'slow6'
+
+        guard5 = fat.GuardDict(ns, 'key')
+        guard6 = fat.GuardDict(ns, 'key')
+        fat.specialize_many([(func5, fast, [guard5]),
+                             (func6, fast, [guard6])])
+        self.assertIs(fat.get_specialized(func5)[0][1][0], guard5)
+        self.assertIs(fat.get_specialized(func6)[0][1][0], guard6)
+
+        self.assertEqual(fat.specialize_many([]), [])
+        self.assertRaises(TypeError, fat.specialize_many, 123)
+
     def test_cellvars(self):
         def func(data, cb):
             return [cb(item) for item in data]
@@ -940,6 +1995,27 @@ class SpecializeTests(BaseTests):
         self.assertRaises(TypeError, fat.guard_type_dict, 123, ('attr',))
         self.assertRaises(TypeError, fat.guard_type_dict, 123, (123,))
 
+    def test_add_arg_types_guard_error(self):
+        with self.assertRaises(TypeError):
+            fat.GuardArgTypes()
+        with self.assertRaises(TypeError):
+            fat.GuardArgTypes(123)
+        with self.assertRaises(ValueError):
+            fat.GuardArgTypes([])
+        with self.assertRaises(TypeError):
+            fat.GuardArgTypes([0])
+        with self.assertRaises(TypeError):
+            fat.GuardArgTypes([("abc", (int,))])
+        with self.assertRaises(ValueError):
+            fat.GuardArgTypes([(-1, (int,))])
+        with self.assertRaises(ValueError):
+            fat.GuardArgTypes([(0, ())])
+
+        with self.assertRaises(TypeError) as cm:
+            fat.GuardArgTypes([(0, (int,)), (1, (123,))])
+        self.assertEqual(str(cm.exception),
+                         "arg_type must be a type, got int")
+
     def test_add_arg_type_guard_error(self):
         # missing 'arg_index' and/or 'type' keys
         with self.assertRaises(TypeError):
@@ -962,6 +2038,43 @@ class SpecializeTests(BaseTests):
         self.assertEqual(str(cm.exception),
                          "arg_type must be a type, got int")
 
+        with self.assertRaises(TypeError):
+            # arg_name is not a str
+            fat.GuardArgType(0, (int,), arg_name=123)
+
+        with self.assertRaises(ValueError):
+            fat.GuardArgType(-1, (int,))
+
+        def func(x):
+            pass
+
+        def func2(x):
+            pass
+
+        with self.assertRaises(ValueError) as cm:
+            # arg_name doesn't match the function parameter
+            fat.specialize(func, func2,
+                           [fat.GuardArgType(0, (int,), arg_name='y')])
+        self.assertEqual(str(cm.exception),
+                         "arg_name 'y' doesn't match the parameter name 'x'")
+
+        # a guard on an argument bound to a function cannot be used for a
+        # function with a different parameter name
+        def func3(y):
+            pass
+
+        for guard in (fat.GuardArgType(0, (int,)),
+                      fat.GuardArgTypes([(0, (int,))]),
+                      fat.GuardArgValue(0, (None,)),
+                      fat.GuardArgIntRange(0, 0, 10),
+                      fat.GuardInstanceShape(int)):
+            fat.specialize(func, func2, [guard])
+            with self.assertRaises(ValueError) as cm:
+                fat.specialize(func3, func2, [guard])
+            self.assertEqual(str(cm.exception),
+                             "arg_name 'x' doesn't match the parameter "
+                             "name 'y'")
+
 
 class MiscTests(BaseTestCase):
     def test_replace_constants(self):
@@ -976,8 +2089,99 @@ class MiscTests(BaseTestCase):
         code2 = fat.replace_consts(code, {3: 'new constant'})
         self.assertEqual(code2.co_consts, (None, 'new constant'))
 
-        code3 = fat.replace_consts(code, {'unknown': 7})
-        self.assertEqual(code3.co_consts, (None, 3))
+        # nothing replaced: return the code unchanged
+        self.assertIs(fat.replace_consts(code, {'unknown': 7}), code)
+        self.assertIs(fat.replace_consts(code, {}), code)
+
+        # unhashable constant
+        code3 = fat.replace_consts(code, {3: ['list']})
+        self.assertEqual(code3.co_consts, (None, ['list']))
+        code4 = fat.replace_consts(code3, {None: 'none'})
+        self.assertEqual(code4.co_consts, ('none', ['list']))
+
+        # large mapping
+        mapping = {'key%s' % i: i for i in range(20)}
+        mapping[3] = 'three'
+        code5 = fat.replace_consts(code, mapping)
+        self.assertEqual(code5.co_consts, (None, 'three'))
+
+        # hashes of keys are read from the mapping: the hash method of a
+        # key is not called, it cannot modify the mapping
+        class Key:
+            ncall = 0
+
+            def __hash__(self):
+                Key.ncall += 1
+                if Key.ncall > 1:
+                    for i in range(20):
+                        mapping['new%s' % i] = i
+                return 12345
+
+        mapping = {Key(): 'key', 3: 'three'}
+        code6 = fat.replace_consts(code, mapping)
+        self.assertEqual(code6.co_consts, (None, 'three'))
+        self.assertEqual(len(mapping), 2)
+
+    def test_replace_names(self):
+        def func(seq):
+            return len(seq) + FACTOR
+
+        code = func.__code__
+        code2 = fat.replace_consts(code, {}, names={'FACTOR': 3, 'len': len})
+        self.assertEqual(code2.co_consts, (None, len, 3))
+        self.assertNotIn(b'%c' % dis.opmap['LOAD_GLOBAL'], code2.co_code[::2])
+        self.assertEqual(len(code2.co_code), len(code.co_code))
+
+        func2 = types.FunctionType(code2, {})
+        self.assertEqual(func2('abc'), 6)
+
+        # constants are replaced before global names
+        code3 = fat.replace_consts(code, {None: 'none'}, names={'FACTOR': None})
+        self.assertEqual(code3.co_consts, ('none', None))
+
+        self.assertRaises(TypeError, fat.replace_consts, code, {}, names=[])
+
+    def _exec(self, source):
+        ns = {}
+        exec(compile(source, 'module.py', 'exec'), ns, ns)
+        return ns
+
+    def test_replace_consts_cached(self):
+        fat.clear_code_cache()
+
+        source = textwrap.dedent('''
+            def func():
+                return (3, FACTOR)
+        ''')
+        # compile the same function twice, as a reloaded module
+        func = self._exec(source)['func']
+        func2 = self._exec(source)['func']
+        self.assertIsNot(func2.__code__, func.__code__)
+
+        code = fat.replace_consts_cached(func.__code__, {3: 4},
+                                         names={'FACTOR': 5})
+        self.assertEqual(types.FunctionType(code, {})(), (4, 5))
+
+        # equal code with equal mapping
+        code2 = fat.replace_consts_cached(func2.__code__, {3: 4},
+                                          names={'FACTOR': 5})
+        self.assertIs(code2, code)
+
+        # values are compared by identity, keys by type and value
+        self.assertIsNot(fat.replace_consts_cached(func.__code__, {3: 4.0},
+                                                   names={'FACTOR': 5}),
+                         code)
+        self.assertIsNot(fat.replace_consts_cached(func.__code__, {3: 4}),
+                         code)
+        self.assertIsNot(fat.replace_consts_cached(func.__code__, {3.0: 4},
+                                                   names={'FACTOR': 5}),
+                         code)
+
+        fat.clear_code_cache()
+        code3 = fat.replace_consts_cached(func.__code__, {3: 4},
+                                          names={'FACTOR': 5})
+        self.assertIsNot(code3, code)
+        self.assertEqual(code3, code)
 
     def test_version(self):
         import setup